@@ -8,6 +8,7 @@
 #include "include/v8.h"
 #include "uv.h"
 #include "http_parser.h"
+#include <zlib.h>
 
 using namespace std;
 using namespace v8;
@@ -37,9 +38,34 @@ static inline long millis(){
         (std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
+// Return monotonic time in milliseconds, comparable between threads and event loops
+static inline uint64_t monotonic_millis(){
+  return uv_hrtime() / 1000000;
+}
+
+// Fast non cryptographic hash, mixes 8 bytes at a time so large pages hash quickly
+static inline uint64_t hash64(const char* data, size_t len){
+  const uint64_t k = 0x9E3779B97F4A7C15ULL;
+  uint64_t hash = len * k;
+  size_t i = 0;
+  for(; i + 8 <= len; i += 8){
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * k;
+    hash ^= hash >> 29;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, len - i);
+  hash = (hash ^ tail) * k;
+  hash ^= hash >> 32;
+  hash *= k;
+  hash ^= hash >> 29;
+  return hash;
+}
+
 // Copy character array
 static inline char* CharCopy(const char* x, int len){
-  char* buf = (char*)malloc(len);
+  char* buf = (char*)malloc(len + 1);
   memcpy(buf, x, len);
   buf[len] = '\0';
   return buf;
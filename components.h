@@ -65,7 +65,7 @@ class LockingQueue : public std::queue<T> {
 template<typename T> 
 class TQueue : public std::queue<T>{
 public:
-  TQueue(){guard = new mutex;}
+  TQueue(){guard = new mutex; _count = 0;}
   virtual ~TQueue(){delete guard;}
 
   void push(T const& _data){
@@ -84,14 +84,23 @@ public:
     return _count;
   }
 
-  T& take(){
+  T take(){
     std::lock_guard<std::mutex> lock(*guard);
-    T& _value = this->front();
+    T _value = this->front();
     this->pop();
     _count --;
     return _value;
   }
 
+  bool tryTake(T& _value){
+    std::lock_guard<std::mutex> lock(*guard);
+    if(queue<T>::empty()) return false;
+    _value = this->front();
+    this->pop();
+    _count --;
+    return true;
+  }
+
 private:
   mutable std::mutex* guard;
   int _count;
@@ -214,6 +223,7 @@ struct AtomicLong{
   ~AtomicLong(){};
   void set(long l){x.store(l);}
   void set_millis(){x.store(millis());}
+  void increment(){x++;}
   long get(){return x.load();}
 };
 
@@ -225,13 +235,135 @@ typedef struct AtomicInt{
   AtomicInt(){};
   ~AtomicInt(){};
   void set(int l){x.store(l);}
-  void increment(){x.store(x.load() + 1);}
-  void decrement(){x.store(x.load() - 1);}
+  void increment(){x++;}
+  void decrement(){x--;}
+  int increment_get(){return ++x;}
+  int decrement_get(){return --x;}
   int get(){return x.load();}
   int load(){return x.load();}
 }AtomicInt;
 
 
+// Free list of reusable objects with hit and miss counters
+// meant to be owned by a single event loop, so it is lockless
+template <typename T>
+class ObjectPool {
+  private:
+    vector<T*> free_list;
+    size_t capacity;
+
+  public:
+    long hits;
+    long misses;
+
+    ObjectPool(size_t _capacity){
+      capacity = _capacity;
+      hits = 0;
+      misses = 0;
+      free_list.reserve(_capacity);
+    };
+
+    virtual ~ObjectPool(){
+      for(T* t : free_list) delete t;
+      free_list.clear();
+    };
+
+    T* acquire(){
+      if(free_list.empty()){
+        misses++;
+        return new T();
+      }
+      hits++;
+      T* t = free_list.back();
+      free_list.pop_back();
+      return t;
+    }
+
+    void release(T* t){
+      if(t == NULL) return;
+      if(free_list.size() < capacity) free_list.push_back(t);
+      else delete t;
+    }
+
+    size_t available(){
+      return free_list.size();
+    }
+};
+
+
+// Free list of fixed size buffers with hit and miss counters
+// meant to be owned by a single event loop, so it is lockless
+class BufferPool {
+  private:
+    vector<char*> free_list;
+    size_t capacity;
+    size_t block_size;
+
+  public:
+    long hits;
+    long misses;
+
+    BufferPool(size_t _block_size, size_t _capacity){
+      block_size = _block_size;
+      capacity = _capacity;
+      hits = 0;
+      misses = 0;
+      free_list.reserve(_capacity);
+    };
+
+    virtual ~BufferPool(){
+      for(char* b : free_list) free(b);
+      free_list.clear();
+    };
+
+    size_t size(){
+      return block_size;
+    }
+
+    char* acquire(){
+      if(free_list.empty()){
+        misses++;
+        return (char*)malloc(block_size);
+      }
+      hits++;
+      char* b = free_list.back();
+      free_list.pop_back();
+      return b;
+    }
+
+    void release(char* b){
+      if(b == NULL) return;
+      if(free_list.size() < capacity) free_list.push_back(b);
+      else free(b);
+    }
+
+    size_t available(){
+      return free_list.size();
+    }
+};
+
+
+// BufferPool shared between threads, for buffers released by another thread than the one
+// that acquired them
+class SharedBufferPool : public BufferPool {
+  private:
+    std::mutex guard;
+
+  public:
+    SharedBufferPool(size_t _block_size, size_t _capacity) : BufferPool(_block_size, _capacity) {};
+
+    char* acquire(){
+      std::lock_guard<std::mutex> lock(guard);
+      return BufferPool::acquire();
+    }
+
+    void release(char* b){
+      std::lock_guard<std::mutex> lock(guard);
+      BufferPool::release(b);
+    }
+};
+
+
 // Append char to buffer fast with malloc + memcpy
 typedef struct stringbuffer{
   char* buf;
@@ -290,110 +422,510 @@ typedef struct __v8_globals{
 } _v8_globals;
 
 
+// Content encoding negotiated with the client, also index of the cached variants
+enum content_encoding { encoding_identity = 0, encoding_gzip, encoding_deflate, encoding_count };
+
+// Immutable response bytes as sent on the wire, shared by the cache and the responses
+// being written so a cache hit is written without copy. Bytes are owned by the buffer
+// or live in the disk cache mapping. The Connection header depends on the connection,
+// it is left out and written between the header fields and the rest of the response
+typedef struct wire_buffer_t {
+  string owned;
+  uv_buf_t buf;
+  size_t fields_len; // header fields up to the empty line ending them
+  string etag; // of the response, compared with If-None-Match on a hit
+
+  wire_buffer_t(string &&data) : owned(std::move(data)) {
+    buf = {.base = (char*) owned.data(), .len = owned.length()};
+    parse();
+  };
+
+  wire_buffer_t(const char* base, size_t len){
+    buf = {.base = (char*) base, .len = len};
+    parse();
+  };
+
+  void parse(){
+    const char* end = (const char*) memmem(buf.base, buf.len, "\r\n\r\n", 4);
+    fields_len = end == NULL ? buf.len : end + 2 - buf.base;
+    etag = header("ETag");
+  }
+
+  // value of a response header, empty when it is not there
+  string header(const char* name){
+    const char* end = (const char*) memmem(buf.base, buf.len, "\r\n\r\n", 4);
+    if(end == NULL) return empty_string;
+    string field = CRLF + name + ": ";
+    const char* at = (const char*) memmem(buf.base, end - buf.base, field.data(), field.length());
+    if(at == NULL) return empty_string;
+    at += field.length();
+    const char* eol = (const char*) memmem(at, end + 2 - at, "\r\n", 2);
+    return string(at, eol - at);
+  }
+
+  wire_buffer_t(const wire_buffer_t&) = delete;
+  wire_buffer_t& operator=(const wire_buffer_t&) = delete;
+} wire_buffer_t;
+
+typedef shared_ptr<const wire_buffer_t> wire_buffer;
+
 // Cache Entry Struct
+// one serialized response per negotiated encoding, so hits never recompress
+// times are monotonic ms as given by uv_now of the calling loop,
+// an expired variant is kept for the stale grace periods and can still be served
 typedef struct cache_entry_t {
-  long start;
-  long timeout;
-  string data;
-
-  cache_entry_t(const string& _data, long _timeout){
-    start = millis(); 
-    timeout = _timeout;
-    data = _data;
+  string key;
+  uint64_t expires[encoding_count]; // per variant, one rendered again is fresh while the others stay stale
+  bool revalidating;
+  wire_buffer data[encoding_count]; // a variant may outlive the entry while it is written
+
+  cache_entry_t(const string &_key){
+    key = _key;
+    for(int i = 0; i < encoding_count; i++) expires[i] = 0;
+    revalidating = false;
   };
 
-  ~cache_entry_t(){
-    println("Destroyed cache entry");
-  };
+  ~cache_entry_t(){};
+
+  bool has_data(int encoding){
+    return data[encoding] != nullptr;
+  }
 
-  bool isExpired(){
-    return (millis() - start) > timeout;
+  // heap memory accounted against the cache budget, mapped variants are not counted
+  size_t bytes(){
+    size_t total = sizeof(cache_entry_t) + key.capacity();
+    for(int i = 0; i < encoding_count; i++) if(data[i]) total += sizeof(wire_buffer_t) + data[i]->owned.capacity();
+    return total;
   }
 
-  bool isExpired(int _timeout){
-    return (millis() - start) > _timeout;
+  bool isExpired(int encoding, uint64_t now){
+    return now > expires[encoding];
+  }
+
+  // may be served while a single background render refreshes it
+  bool isStaleWhileRevalidate(int encoding, uint64_t now){
+    return now <= expires[encoding] + cache_stale_while_revalidate;
+  }
+
+  // may be served when the render of a fresh page fails
+  bool isStaleIfError(int encoding, uint64_t now){
+    return now <= expires[encoding] + cache_stale_if_error;
+  }
+
+  // time after which the variant is of no use at all
+  uint64_t staleUntil(int encoding){
+    return expires[encoding] + max(cache_stale_while_revalidate, cache_stale_if_error);
+  }
+
+  // time after which no variant is of any use
+  uint64_t staleUntil(){
+    uint64_t latest = 0;
+    for(int i = 0; i < encoding_count; i++) if(data[i]) latest = max(latest, staleUntil(i));
+    return latest;
   }
   
 } cache_entry_t;
 
 
-typedef unique_ptr<cache_entry_t> cache_entry;
-typedef map<const string, cache_entry> cache_storage;
-typedef map<const string, cache_entry>::iterator cache_iterator;
-typedef pair<const string, cache_entry> cache_pair;
+typedef shared_ptr<cache_entry_t> cache_entry;
+enum cache_lookup { cache_miss = 0, cache_fresh, cache_stale };
+typedef list<cache_entry> cache_lru;
+typedef unordered_map<string, cache_lru::iterator> cache_index;
+
+// Timer of a cache entry, the entry is only expired if it is still the one stored under key
+typedef struct wheel_timer {
+  string key;
+  uint64_t expires;
+  weak_ptr<cache_entry_t> entry;
+} wheel_timer;
+
+// Hierarchical timer wheel : 256 slots of one tick, then 256 slots of 256 ticks.
+// Timers further away are parked in the last outer slot and placed again when it cascades.
+class TimerWheel {
+  private:
+    static const int slot_count = 256;
+    vector<wheel_timer> inner[slot_count];
+    vector<wheel_timer> outer[slot_count];
+    uint64_t current_tick;
+    uint64_t resolution;
+    std::mutex guard;
+
+    void insert(wheel_timer &t){
+      uint64_t tick = t.expires / resolution;
+      if(tick <= current_tick) tick = current_tick + 1;
+      uint64_t delta = tick - current_tick;
+      if(delta < slot_count){
+        inner[tick % slot_count].push_back(std::move(t));
+      }
+      else {
+        if(delta >= (uint64_t) slot_count * slot_count) tick = current_tick + slot_count * slot_count - 1;
+        outer[(tick / slot_count) % slot_count].push_back(std::move(t));
+      }
+    }
+
+    // timers due are moved to expired, the others are placed again
+    void drain(vector<wheel_timer> &slot, uint64_t now, vector<wheel_timer> &expired){
+      vector<wheel_timer> timers;
+      timers.swap(slot);
+      for(wheel_timer &t : timers){
+        if(t.expires <= now) expired.push_back(std::move(t));
+        else insert(t);
+      }
+    }
+
+  public:
+    TimerWheel(uint64_t _resolution){
+      resolution = _resolution;
+      current_tick = 0;
+    };
+    virtual ~TimerWheel(){};
+
+    void schedule(const string &key, uint64_t expires, const shared_ptr<cache_entry_t> &entry, uint64_t now){
+      std::lock_guard<std::mutex> lock(guard);
+      wheel_timer t = {key, expires, entry};
+      if(current_tick == 0) current_tick = now / resolution; // first timer sets the clock
+      insert(t);
+    }
+
+    // move the wheel to now and collect every timer that is due
+    void advance(uint64_t now, vector<wheel_timer> &expired){
+      std::lock_guard<std::mutex> lock(guard);
+      uint64_t target = now / resolution;
+      if(current_tick == 0) current_tick = target;
+      if(target <= current_tick) return; // another loop already moved the wheel past now
+      if(target - current_tick > (uint64_t) slot_count * slot_count) current_tick = target - slot_count * slot_count;
+      while(current_tick < target){
+        current_tick++;
+        if(current_tick % slot_count == 0) drain(outer[(current_tick / slot_count) % slot_count], now, expired);
+        drain(inner[current_tick % slot_count], now, expired);
+      }
+    }
+};
+
+
+// One shard of the page cache : hash index into a LRU list, guarded by its own lock
+typedef struct cache_shard {
+  std::mutex guard;
+  cache_lru lru;
+  cache_index index;
+  size_t bytes;
+  size_t budget;
+
+  cache_shard(){
+    bytes = 0;
+    budget = 0;
+  };
+
+  void erase(cache_index::iterator it){
+    bytes -= (*it->second)->bytes();
+    lru.erase(it->second);
+    index.erase(it);
+  }
+
+  // drop least recently used entries until the shard fits its budget
+  void evict(){
+    while(bytes > budget && !lru.empty()){
+      erase(index.find(lru.back()->key));
+    }
+  }
+} cache_shard;
+
+// Page cache shared by every http event loop
+// keys are spread over shards so loops rarely wait on the same lock,
+// every shard evicts its least recently used pages to stay within its part of the byte budget
+// pages are freed proactively by a timer wheel advanced from an event loop timer
 typedef struct cache_map {
-  cache_storage* _map;
+  cache_shard* shards;
+  int shard_count;
+  TimerWheel wheel;
 
-  cache_map(){
-    _map = new cache_storage();
+  cache_map() : wheel(cache_tick) {
+    shard_count = cache_shards;
+    shards = new cache_shard[shard_count];
+    for(int i = 0; i < shard_count; i++) shards[i].budget = cache_budget_bytes / shard_count;
   }
 
   ~cache_map(){
-    _map->clear();
-    delete _map;
+    delete[] shards;
   }
 
-  string add(const string &key, const string &value, const long timeout){
-    _map->insert(cache_pair(
-        key,
-        make_unique<cache_entry_t>(value, timeout)
-        ));
+  cache_shard& shard(const string &key){
+    return shards[std::hash<string>()(key) % shard_count];
+  }
+
+  // add or refresh a variant of a page, the other variants keep their own expiry
+  wire_buffer add(const string &key, int encoding, string value, const long timeout, uint64_t now){
+    return add(key, encoding, make_shared<const wire_buffer_t>(std::move(value)), timeout, now);
+  }
+
+  // add variant of a page that lives in the disk cache mapping, the mapping outlives the cache
+  wire_buffer addMapped(const string &key, int encoding, const char* base, size_t len, const long timeout, uint64_t now){
+    return add(key, encoding, make_shared<const wire_buffer_t>(base, len), timeout, now);
+  }
+
+  wire_buffer add(const string &key, int encoding, wire_buffer value, const long timeout, uint64_t now){
+    cache_shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.guard);
+    cache_entry &entry = find_or_insert(s, key);
+    uint64_t stale_until = entry->staleUntil();
+    s.bytes -= entry->bytes();
+    for(int i = 0; i < encoding_count; i++){
+      if(entry->data[i] && now > entry->staleUntil(i)) entry->data[i].reset(); // past every grace period
+    }
+    entry->data[encoding] = value;
+    entry->expires[encoding] = now + timeout;
+    entry->revalidating = false; // another stale variant may start its own revalidation
+    s.bytes += entry->bytes();
+    // the entry lives until its last variant is of no use, an earlier timer is skipped by expire
+    if(entry->staleUntil() > stale_until) wheel.schedule(key, entry->staleUntil(), entry, now);
+    s.evict();
     return value;
   }
 
+  // entry of key made most recently used, shard lock must be held
+  cache_entry& find_or_insert(cache_shard &s, const string &key){
+    cache_index::iterator it = s.index.find(key);
+    if (it == s.index.end()){
+      s.lru.push_front(make_shared<cache_entry_t>(key));
+      it = s.index.insert({key, s.lru.begin()}).first;
+      s.bytes += s.lru.front()->bytes();
+    }
+    else {
+      s.lru.splice(s.lru.begin(), s.lru, it->second);
+    }
+    return *it->second;
+  }
+
   int count(const string &key){
-    return _map->count(key);
-  }
-
-  string* get(const string &key){
-    cache_iterator it = _map->find(key);
-    string* data;
-    // if found
-    if (it!=_map->end()){
-      cache_entry &entry = it->second;
-      if(entry->isExpired()){
-        _map->erase(key);
-        return NULL;
-      } 
-      else {
-        return &entry->data;
-      } 
-    } 
+    cache_shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.guard);
+    return s.index.count(key);
+  }
+
+  // shared buffer of the cached response, it stays valid after the entry is evicted.
+  // A stale page is returned within the stale-while-revalidate window, revalidate is set
+  // for the first caller only, who must render the page again or call revalidateFailed
+  int get(const string &key, int encoding, wire_buffer* buf, uint64_t now, bool* revalidate){
+    *revalidate = false;
+    cache_shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.guard);
+    cache_index::iterator it = s.index.find(key);
     // if not found
-    return NULL;
+    if (it == s.index.end()) return cache_miss;
+
+    cache_entry &entry = *it->second;
+    if(!entry->has_data(encoding)) return cache_miss;
+
+    int state = cache_fresh;
+    if(entry->isExpired(encoding, now)){
+      if(!entry->isStaleWhileRevalidate(encoding, now)) return cache_miss; // freed by the timer wheel or the next add
+      state = cache_stale;
+      if(!entry->revalidating) *revalidate = entry->revalidating = true;
+    }
+
+    s.lru.splice(s.lru.begin(), s.lru, it->second); // most recently used
+    *buf = entry->data[encoding];
+    return state;
+  }
+
+  // expired page still within the stale-if-error window
+  bool getStale(const string &key, int encoding, wire_buffer* buf, uint64_t now){
+    cache_shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.guard);
+    cache_index::iterator it = s.index.find(key);
+    if (it == s.index.end()) return false;
+    cache_entry &entry = *it->second;
+    if(!entry->has_data(encoding) || !entry->isStaleIfError(encoding, now)) return false;
+    *buf = entry->data[encoding];
+    return true;
+  }
+
+  // let the next request try to revalidate the page again
+  void revalidateFailed(const string &key){
+    cache_shard &s = shard(key);
+    std::lock_guard<std::mutex> lock(s.guard);
+    cache_index::iterator it = s.index.find(key);
+    if (it != s.index.end()) (*it->second)->revalidating = false;
+  }
+
+  // free every page whose timer is due
+  void expire(uint64_t now){
+    vector<wheel_timer> expired;
+    wheel.advance(now, expired);
+    for(wheel_timer &t : expired){
+      shared_ptr<cache_entry_t> entry = t.entry.lock();
+      if(!entry) continue; // already evicted
+      cache_shard &s = shard(t.key);
+      std::lock_guard<std::mutex> lock(s.guard);
+      cache_index::iterator it = s.index.find(t.key);
+      if(it != s.index.end() && *it->second == entry && entry->staleUntil() <= now) s.erase(it);
+    }
   }
 
 } cache_map;
 
 
+// cache decision of a url, ttl in ms
+typedef struct cache_rule {
+  bool cache;
+  long ttl;
+} cache_rule;
+
+// node of the cache rule trie, one level per path segment
+typedef struct rule_node {
+  vector<pair<string, rule_node*>> literals;
+  vector<pair<string, rule_node*>> globs; // segment with '*' or '?', matched with fnmatch
+  rule_node* param; // ':name' or '*', any single segment
+  rule_node* rest; // '**' as last segment, any remaining segments
+  bool terminal;
+  cache_rule rule;
+
+  rule_node(){
+    param = NULL;
+    rest = NULL;
+    terminal = false;
+    rule = {false, 0};
+  };
+
+  ~rule_node(){
+    for(auto &c : literals) delete c.second;
+    for(auto &c : globs) delete c.second;
+    delete param;
+    delete rest;
+  };
+
+  rule_node* child(const string &segment){
+    vector<pair<string, rule_node*>> &children = segment.find_first_of("*?[") == string::npos ? literals : globs;
+    for(auto &c : children) if(c.first == segment) return c.second;
+    children.push_back({segment, new rule_node});
+    return children.back().second;
+  }
+} rule_node;
+
 // struct to check url that can be cached
-// this one is lockless because content is unmodifiable
-typedef pair<const string, const bool>  url_pair;
+// rules are compiled into a trie of path segments before the server starts,
+// it is lockless because content is unmodifiable afterwards.
+// Literal segments win over glob segments, then params, then '**'
 typedef struct cacheable{
-  map<const string, const bool>* _map;
+  rule_node* root;
 
   cacheable(){
-    _map = new map<const string, const bool>();
+    root = new rule_node;
   };
 
   ~cacheable(){
-    _map->clear();
-    delete _map;
+    delete root;
   };
 
-  void add(const char* arg, ...) {
-    va_list arguments;
+  // patterns cached for cache_timeout
+  template<typename... Patterns>
+  void add(const char* pattern, Patterns... patterns) {
+    add_rule(pattern, {true, cache_timeout});
+    add(patterns...);
+  }
+  void add(){}
+
+  // pattern is a path like /item/:id, /blog/*.html or /assets/**, the query is ignored
+  bool add_rule(const string &pattern, cache_rule rule){
+    if(pattern.empty() || pattern[0] != '/') return false;
+    rule_node* node = root;
+    size_t pos = 1;
+    while(true){
+      size_t end = pattern.find('/', pos);
+      string segment = pattern.substr(pos, end == string::npos ? string::npos : end - pos);
+      if(segment == "**"){
+        if(end != string::npos) return false; // only as last segment
+        if(node->rest == NULL) node->rest = new rule_node;
+        node = node->rest;
+        break;
+      }
+      if(segment == "*" || (!segment.empty() && segment[0] == ':')){
+        if(node->param == NULL) node->param = new rule_node;
+        node = node->param;
+      }
+      else node = node->child(segment);
+      if(end == string::npos) break;
+      pos = end + 1;
+    }
+    node->terminal = true;
+    node->rule = rule;
+    return true;
+  }
+
+  // one rule per line : pattern followed by the ttl in seconds or 'nocache',
+  // the ttl defaults to cache_timeout, lines starting with '#' are comments.
+  // The file replaces the rules only when every line is valid, otherwise they are left as they were
+  bool load(const char* path){
+    ifstream file(path);
+    if(!file.is_open()) return false;
+    cacheable parsed;
+    string line;
+    int number = 0;
+    while(getline(file, line)){
+      number++;
+      istringstream fields(line);
+      string pattern, ttl;
+      if(!(fields >> pattern) || pattern[0] == '#') continue;
+      fields >> ttl;
+      cache_rule rule = {true, cache_timeout};
+      if(ttl == "nocache") rule = {false, 0};
+      else if(!ttl.empty()) rule.ttl = atol(ttl.c_str()) * 1000;
+      if((rule.cache && rule.ttl <= 0) || !parsed.add_rule(pattern, rule)){
+        fprintf(stderr, "%s:%d invalid cache rule : %s\n", path, number, line.c_str());
+        return false;
+      }
+    }
+    std::swap(root, parsed.root); // the previous rules are freed with parsed
+    return true;
+  }
 
-    for (va_start(arguments, arg); arg != NULL; arg = va_arg(arguments, const char *)) {
-        //printf("%s:%d\n",arg, strlen(arg));
-        _map->insert({arg, true});
+  // rule of url, false when no rule matches
+  bool match(const string &url, cache_rule* rule){
+    size_t len = url.find_first_of("?#");
+    if(len == string::npos) len = url.length();
+    if(len == 0 || url[0] != '/') return false;
+    return match(root, url.c_str() + 1, url.c_str() + len, rule);
+  }
+
+  // segment starts at p, p is NULL once every segment is matched
+  static bool match(rule_node* node, const char* p, const char* end, cache_rule* rule){
+    if(p == NULL){
+      if(node->terminal){
+        *rule = node->rule;
+        return true;
+      }
+      if(node->rest != NULL && node->rest->terminal){
+        *rule = node->rest->rule;
+        return true;
+      }
+      return false;
     }
 
-    va_end(arguments);
+    const char* segment_end = (const char*) memchr(p, '/', end - p);
+    if(segment_end == NULL) segment_end = end;
+    size_t len = segment_end - p;
+    const char* next = segment_end == end ? NULL : segment_end + 1;
+
+    for(auto &c : node->literals){
+      if(c.first.length() == len && memcmp(c.first.data(), p, len) == 0 && match(c.second, next, end, rule)) return true;
+    }
+    if(!node->globs.empty()){
+      string segment(p, len);
+      for(auto &c : node->globs){
+        if(fnmatch(c.first.c_str(), segment.c_str(), 0) == 0 && match(c.second, next, end, rule)) return true;
+      }
+    }
+    if(node->param != NULL && len > 0 && match(node->param, next, end, rule)) return true;
+    if(node->rest != NULL && node->rest->terminal){
+      *rule = node->rest->rule;
+      return true;
+    }
+    return false;
   }
 
-  bool is_cache(const string &key){
-    return ( !(_map->find(key) == _map->end()) )? true : false;
+  bool is_cache(const string &url){
+    cache_rule rule;
+    return match(url, &rule) && rule.cache;
   }
 
 } cacheable;
@@ -0,0 +1,202 @@
+// pragma once is a non-standard but widely supported preprocessor directive,
+// designed to cause the current source file to be included only once in a single compilation
+#pragma once 
+#include "components.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define DISK_CACHE_MAGIC 0x56385243
+#define DISK_CACHE_VERSION 2 // 2 : pages are stored without the Connection header
+
+// Both files start with this header, files of another format or bundle are started over
+typedef struct disk_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t bundle_hash;
+} disk_cache_header;
+
+// Index record of one page variant, followed by key_len bytes of key.
+// Records are only appended, the last record of a key and encoding wins
+typedef struct disk_cache_record {
+  uint64_t offset; // of the variant in the data file
+  uint64_t length;
+  int64_t expires; // wall clock ms
+  uint32_t checksum; // crc32 of the variant
+  uint32_t record_checksum; // crc32 of the record and key, computed with this field at 0
+  uint16_t key_len;
+  uint8_t encoding;
+  uint8_t reserved[5];
+} disk_cache_record;
+
+typedef struct disk_cache_write {
+  string key;
+  int encoding;
+  wire_buffer data; // shared with the page cache, not copied
+  int64_t expires;
+} disk_cache_write;
+
+// Page cache kept on disk across restarts in an index file and an append-only data file.
+// Data is mapped read-only when the cache is opened and loaded pages point into the mapping,
+// the mapping is never unmapped. Pages rendered afterwards are appended by a writer thread
+// so the event loops never wait on the disk
+class DiskCache {
+  private:
+    string index_path;
+    string data_path;
+    int index_fd;
+    int data_fd;
+    uint64_t bundle_hash;
+    uint64_t data_size;
+    char* mapping;
+    size_t mapping_size;
+    LockingQueue<disk_cache_write*> writes;
+    Thread* writer;
+
+    // open file, started over when its header does not match
+    int open_file(const string &path){
+      int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      if(fd < 0) return fd;
+      disk_cache_header header;
+      bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && header.magic == DISK_CACHE_MAGIC && header.version == DISK_CACHE_VERSION
+        && header.bundle_hash == bundle_hash;
+      if(!valid){
+        header = {DISK_CACHE_MAGIC, DISK_CACHE_VERSION, bundle_hash};
+        if(ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+          close(fd);
+          return -1;
+        }
+      }
+      return fd;
+    }
+
+    static uint32_t checksum(const char* data, size_t len, uint32_t crc = 0){
+      return crc32(crc, (const Bytef*) data, len);
+    }
+
+    static uint32_t record_checksum(disk_cache_record record, const char* key){
+      record.record_checksum = 0;
+      return checksum(key, record.key_len, checksum((const char*) &record, sizeof(record)));
+    }
+
+    void run(){
+      disk_cache_write* w;
+      bool full = false;
+      while(true){
+        writes.waitAndPop(w);
+        if(data_size + w->data->buf.len > disk_cache_max_bytes){
+          if(!full) fprintf(stderr, "Disk cache is full, pages are no longer written\n");
+          full = true;
+        }
+        else if(!append(w)){
+          fprintf(stderr, "Disk cache write error %s\n", strerror(errno));
+        }
+        delete w;
+      }
+    }
+
+    // data is written before its index record, a torn record fails its checksum at load
+    bool append(disk_cache_write* w){
+      const uv_buf_t &data = w->data->buf;
+      if(pwrite(data_fd, data.base, data.len, data_size) != (ssize_t) data.len) return false;
+      disk_cache_record record;
+      memset(&record, 0, sizeof(record));
+      record.offset = data_size;
+      record.length = data.len;
+      record.expires = w->expires;
+      record.checksum = checksum(data.base, data.len);
+      record.key_len = w->key.length();
+      record.encoding = w->encoding;
+      record.record_checksum = record_checksum(record, w->key.c_str());
+      data_size += record.length;
+
+      string out((const char*) &record, sizeof(record));
+      out.append(w->key);
+      return write(index_fd, out.data(), out.length()) == (ssize_t) out.length();
+    }
+
+  public:
+    DiskCache(const char* dir, uint64_t _bundle_hash){
+      bundle_hash = _bundle_hash;
+      index_path = string(dir) + "/index";
+      data_path = string(dir) + "/data";
+      mapping = NULL;
+      mapping_size = 0;
+      data_size = 0;
+      writer = NULL;
+      mkdir(dir, 0755);
+      index_fd = open_file(index_path);
+      data_fd = open_file(data_path);
+      if(isOpen()){
+        data_size = lseek(data_fd, 0, SEEK_END);
+        lseek(index_fd, 0, SEEK_END);
+      }
+    };
+
+    ~DiskCache(){};
+
+    bool isOpen(){
+      return index_fd >= 0 && data_fd >= 0;
+    }
+
+    // map the data file and add every valid page that has not expired to cache,
+    // returns the number of variants loaded
+    int load(cache_map* cache, uint64_t now){
+      if(!isOpen()) return 0;
+      if(data_size > sizeof(disk_cache_header)){
+        void* m = mmap(NULL, data_size, PROT_READ, MAP_SHARED, data_fd, 0);
+        if(m == MAP_FAILED) return 0;
+        mapping = (char*) m;
+        mapping_size = data_size;
+      }
+
+      string index = read_index();
+      size_t pos = sizeof(disk_cache_header);
+      int64_t wall = millis();
+      int loaded = 0;
+      while(mapping != NULL && pos + sizeof(disk_cache_record) <= index.length()){
+        disk_cache_record record;
+        memcpy(&record, index.data() + pos, sizeof(record));
+        const char* key = index.data() + pos + sizeof(record);
+        if(pos + sizeof(record) + record.key_len > index.length()) break;
+        if(record.record_checksum != record_checksum(record, key)) break;
+        pos += sizeof(record) + record.key_len;
+
+        if(record.encoding >= encoding_count || record.expires <= wall) continue;
+        if(record.offset < sizeof(disk_cache_header) || record.offset + record.length > mapping_size) continue;
+        const char* data = mapping + record.offset;
+        if(record.checksum != checksum(data, record.length)) continue;
+
+        cache->addMapped(string(key, record.key_len), record.encoding, data, record.length, record.expires - wall, now);
+        loaded++;
+      }
+
+      // drop a torn record so the records appended after it can be read
+      if(pos < index.length() && ftruncate(index_fd, pos) == 0) lseek(index_fd, pos, SEEK_SET);
+      return loaded;
+    }
+
+    string read_index(){
+      string index;
+      char buf[65536];
+      ssize_t n;
+      off_t offset = 0;
+      while((n = pread(index_fd, buf, sizeof(buf), offset)) > 0){
+        index.append(buf, n);
+        offset += n;
+      }
+      return index;
+    }
+
+    void start(){
+      writer = new Thread([this](){ run(); });
+      writer->start_detached();
+    }
+
+    // queue a page variant to be written, expires is wall clock ms
+    void append(const string &key, int encoding, wire_buffer data, int64_t expires){
+      if(writer == NULL) return;
+      writes.push(new disk_cache_write{key, encoding, data, expires});
+    }
+};
@@ -12,7 +12,6 @@ typedef std::function<void(const v8::FunctionCallbackInfo<v8::Value>&)> v8_callb
 
 // Prototypes
 static void ReportException(Isolate* isolate, TryCatch* try_catch);
-//static void TerminateExecution(v8::Isolate *isolate);
 static inline bool ExecuteString(Isolate* isolate, Local<String> source,
                    Local<String> _name,
                    bool report_exceptions);
@@ -23,20 +22,83 @@ static inline void SetTimeout(const FunctionCallbackInfo<Value> &info);
 static inline size_t WriteCallback(char *contents, size_t size, size_t nmemb, void *userp);
 static void HttpGet(const FunctionCallbackInfo<Value>& info);
 static inline void js_callback(const FunctionCallbackInfo<Value>& info);
+static void SetRequest(Isolate* isolate, const char* request);
 static std::string LoadScript();
-static void engineProcess(const char* startup_location, const char* socket_addr);
+static void engineProcess(const char* startup_location, const char* socket_addr, ShmChannel* channel);
 int startEngine(char* argv[]);
 // End Prototypes
 
 
+// monotonic ms the render in progress must be done by, bounds the calls it makes
+static uint64_t render_deadline = 0;
+
 // Modify job and job queue type here
 typedef HttpData* job_type;
 typedef LockingQueue<job_type> jobqueue_type;
 typedef LockingQueue<job_type>* jobqueue_pointer;
 
 
+// Terminate Javascript Execution on an isolate
+// Watchdog thread armed for every render, it calls TerminateExecution once the deadline passes.
+// TerminateExecution is safe to call from another thread, the render thread then cancels
+// the termination so the isolate can keep serving.
+typedef struct render_watchdog {
+  Isolate* isolate;
+  std::mutex guard;
+  std::condition_variable signal;
+  bool armed;
+  bool fired;
+  uint64_t deadline;
+  Thread* thread;
+
+  render_watchdog(Isolate* _isolate){
+    isolate = _isolate;
+    armed = false;
+    fired = false;
+    deadline = 0;
+    thread = new Thread([this](){ run(); });
+    thread->start_detached();
+  };
+
+  ~render_watchdog(){};
+
+  void arm(long _timeout){
+    std::lock_guard<std::mutex> lock(guard);
+    armed = true;
+    fired = false;
+    deadline = monotonic_millis() + _timeout;
+    signal.notify_one();
+  }
+
+  // returns true when the render has been terminated
+  bool disarm(){
+    std::lock_guard<std::mutex> lock(guard);
+    armed = false;
+    return fired;
+  }
+
+  void run(){
+    std::unique_lock<std::mutex> lock(guard);
+    while(true){
+      if(!armed){
+        signal.wait(lock);
+        continue;
+      }
+      uint64_t now = monotonic_millis();
+      if(now < deadline){
+        signal.wait_for(lock, std::chrono::milliseconds(deadline - now));
+        continue;
+      }
+      isolate->TerminateExecution();
+      fired = true;
+      armed = false;
+    }
+  }
+} render_watchdog;
+
+
 // V8 Engine Process
-static void engineProcess(const char* startup_location, const char* socket_addr){
+static void engineProcess(const char* startup_location, const char* socket_addr, ShmChannel* channel){
   printf("Startup Location Argument: %s\n", startup_location);
   static const char* process_name = str_format("V8 Process: %s", socket_addr);
 
@@ -97,17 +159,40 @@ static void engineProcess(const char* startup_location, const char* socket_addr)
     ExecuteString(isolate, CreateString(isolate, script_template), threadName, true);
     while (v8::platform::PumpMessageLoop(platform, isolate)) continue;
 
-    static auto render = [](const char* url)->char*{
+    static render_watchdog watchdog(isolate);
+    static auto render = [](const char* request)->char*{
       render_buffer.reset();
       script_buffer.reset();
-      render_buffer.add("<html><head></head><body>");
 
-      script_buffer.adds("currentRoute = '")->adds(url)->adds("';");
+      // the request starts with its deadline, the render gets what is left of it
+      char* url;
+      render_deadline = strtoull(request, &url, 10);
+      if (*url == ' ') request = url + 1;
+      else render_deadline = monotonic_millis() + timeout;
+      uint64_t now = monotonic_millis();
+      long budget = render_deadline > now ? render_deadline - now : 0;
+      if (budget == 0) { // answered with the fallback page by the balancer already
+        render_buffer.adds(render_fallback_marker)->add(fallback_page);
+        return render_buffer.str();
+      }
+
+      render_buffer.add("<html><head></head><body>");
+      watchdog.arm(budget);
+      SetRequest(isolate, request);
       script_buffer.add("renderVueComponentToString(server.createApp(), (err, res) => {print(res);});");
 
       ExecuteString(isolate, CreateString(isolate, script_buffer.str()), threadName, true);
       while (v8::platform::PumpMessageLoop(platform, isolate)) continue;
 
+      // render took too long, recover the isolate and send the fallback page
+      if (watchdog.disarm()) {
+        isolate->CancelTerminateExecution();
+        fprintf(stderr, "%s : render terminated after %ld ms\n", process_name, budget);
+        render_buffer.reset();
+        render_buffer.adds(render_fallback_marker)->add(fallback_page);
+        return render_buffer.str();
+      }
+
       render_buffer.adds("</body>")->adds(css.c_str())->add("</html>");
       return render_buffer.str();
     };
@@ -116,10 +201,11 @@ static void engineProcess(const char* startup_location, const char* socket_addr)
     printf("Starting IPC Server %s\n", socket_addr);
     unlink(socket_addr); // unlink first to avoid name collision
     ipc::IpcServer ipc_server([](ipc::ipc_call* ipc){
-      ipc->send(render(ipc->req.base));
+      char* page = render(ipc->req.base);
+      ipc->send(page, render_buffer.length);
     });
     // End Worker Thread Execution Loop
-    ipc_server.listen(socket_addr);
+    ipc_server.listen(socket_addr, channel);
     
   }// End Isolate Block Scope Function
   isolate->Dispose();
@@ -190,6 +276,7 @@ static inline bool ExecuteString(Isolate* isolate, Local<String> source,
     Local<Value> result;
     if (!script->Run(context).ToLocal(&result)) {
       assert(try_catch.HasCaught());
+      if (try_catch.HasTerminated()) return false; // terminated by the render watchdog
       // Print errors that happened during execution.
       if (report_exceptions)
         ReportException(isolate, &try_catch);
@@ -201,32 +288,6 @@ static inline bool ExecuteString(Isolate* isolate, Local<String> source,
 }
 
 
-// Terminate Javascript Execution on an isolate
-// static void TerminateExecution(v8::Isolate *isolate)
-// {
-// 	if(isolate->IsExecutionTerminating()) {
-// 		/* Execution already terminating, needn't trigger it again and
-// 		 * especially must not execute the spinning loop (which would cause
-// 		 * crashes in V8 itself, at least with 4.2 and 4.3 version lines). */
-// 		return;
-// 	}
-
-// 	/* Unfortunately just calling TerminateExecution on the isolate is not
-// 	 * enough, since v8 just marks the thread as "to be aborted" and doesn't
-// 	 * immediately do so.  Hence we enter an endless loop after signalling
-// 	 * termination, so we definitely don't execute JS code after the exit()
-// 	 * statement. */
-// 	/* Don't forget the locker if you use 1 isolate for multiple threads
-//      * v8::Locker locker(isolate);
-// 	 * v8::Isolate::Scope isolate_scope(isolate);*/
-// 	v8::HandleScope handle_scope(isolate);
-// 	v8::Local<v8::String> source = CreateString(isolate, "for(;;);");
-// 	v8::Local<v8::Script> script = v8::Script::Compile(source);
-// 	isolate->TerminateExecution();
-// 	script->Run();
-// }
-
-
 // Javascript Set Timeout
 static inline void SetTimeout(const FunctionCallbackInfo<Value> &info) {
   HandleScope scope(info.GetIsolate());  // To prevent memory leak, use handlescope
@@ -250,11 +311,22 @@ static void HttpGet(const FunctionCallbackInfo<Value>& info) {
   Isolate* isolate = info.GetIsolate();
   HandleScope scope(isolate);  // To prevent memory leak, use handlescope
   
+  // the watchdog can not interrupt curl, so curl gets what is left of the render deadline
+  uint64_t now = monotonic_millis();
+  if (render_deadline <= now) {
+    info.GetReturnValue().Set(CreateString(isolate, ""));
+    return;
+  }
+  long budget = render_deadline - now;
+
   CURL* easyhandle = curl_easy_init();
   std::string readBuffer;
   String::Utf8Value str(isolate, info[0]);
   const char* url = ToCString(str);
   curl_easy_setopt(easyhandle, CURLOPT_URL, url);
+  curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS, budget);
+  curl_easy_setopt(easyhandle, CURLOPT_CONNECTTIMEOUT_MS, budget);
+  curl_easy_setopt(easyhandle, CURLOPT_NOSIGNAL, 1L); // timeouts without SIGALRM
   curl_easy_setopt(easyhandle, CURLOPT_VERBOSE, 0L); //1 on, 0 off
   curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, WriteCallback);
   curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, &readBuffer);
@@ -273,6 +345,40 @@ static inline void js_callback(const FunctionCallbackInfo<Value>& info){
 }
 
 
+// Expose the request forwarded by the balancer to javascript :
+// currentRoute holds the url and currentRequest = { url, headers } with lower case header names.
+// Request is the url on the first line followed by one "Name: value" line per header
+static void SetRequest(Isolate* isolate, const char* request) {
+  HandleScope scope(isolate);
+  Local<v8::Context> context = isolate->GetCurrentContext();
+  Local<Object> headers = Object::New(isolate);
+
+  const char* line_end = strchr(request, '\n');
+  string url = line_end ? string(request, line_end - request) : string(request);
+
+  while (line_end) {
+    const char* line = line_end + 1;
+    line_end = strchr(line, '\n');
+    size_t line_len = line_end ? (size_t)(line_end - line) : strlen(line);
+    const char* separator = (const char*) memchr(line, ':', line_len);
+    if (separator == NULL) continue;
+
+    string key(line, separator - line);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    const char* value = separator + 1;
+    while (value < line + line_len && *value == ' ') value++;
+    headers->Set(context, CreateString(isolate, key),
+      String::NewFromUtf8(isolate, value, NewStringType::kNormal, line + line_len - value).ToLocalChecked()).FromJust();
+  }
+
+  Local<Object> req = Object::New(isolate);
+  req->Set(context, CreateString(isolate, "url"), CreateString(isolate, url)).FromJust();
+  req->Set(context, CreateString(isolate, "headers"), headers).FromJust();
+  context->Global()->Set(context, CreateString(isolate, "currentRoute"), CreateString(isolate, url)).FromJust();
+  context->Global()->Set(context, CreateString(isolate, "currentRequest"), req).FromJust();
+}
+
+
 // Creates a new execution environment containing the built-in functions.
 static Local<v8::Context> CreateContext(Isolate* isolate, function<void(const FunctionCallbackInfo<Value>&)> methods[]) {
   // Create a template for the global object.
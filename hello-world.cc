@@ -3,109 +3,418 @@
 // found in the LICENSE file.
 #include "engine.h"
 #include <exception>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 using namespace std; 
 
 static void on_pipe_connect(uv_connect_t* connect, int status);
 static void on_ipc_write(uv_write_t* req, int status);
 static void on_ipc_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf);
+static void frame_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
 static void async_pipe_write(uv_async_t *handle);
+static void on_shm_answer(uv_poll_t* handle, int status, int events);
+static void on_pipe_closed(uv_handle_t* handle);
+static void restart_renderer(uv_timer_t* timer);
 static void check_pending_queue (uv_timer_t* timer, int status);
+static void check_deadlines (uv_timer_t* timer);
 
 typedef HttpData* balancer_job;
+class Balancer;
+struct BalancerWorker;
+
+static void read_shm_answers(BalancerWorker* w);
+
+// renderer process forked by the supervisor, forked again when it exits
+typedef struct renderer_process{
+  const char* socket_path;
+  ShmChannel* channel; // rings shared with the renderer, NULL for the pipe only
+  int pid; // 0 while waiting to be forked again, -1 when the fork failed
+  uint64_t started; // monotonic ms of the last fork
+  uint64_t restart_at; // monotonic ms the renderer is forked again
+  int failures; // exits in a row that came soon after the start
+}renderer_process;
+
+// fork a renderer serving socket_path, the child never returns. The child only keeps
+// stdio and the eventfds of its channel, the rings stay mapped
+static void spawn_renderer(renderer_process* renderer, const char* startup_location){
+  unlink(renderer->socket_path);
+  int parent = getpid();
+  int pid = fork();
+  if(pid == 0){ // forked process
+    prctl(PR_SET_PDEATHSIG, SIGKILL); // dies with the supervisor
+    if(getppid() != parent) _exit(0);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGCHLD, SIG_DFL);
+
+    int first = 3;
+    ShmChannel* channel = renderer->channel;
+    if(channel != NULL){ // move the eventfds out of the way, then down to 3 and 4
+      int request_fd = fcntl(channel->request_fd, F_DUPFD, 64);
+      int answer_fd = fcntl(channel->answer_fd, F_DUPFD, 64);
+      channel->request_fd = dup2(request_fd, first++);
+      channel->answer_fd = dup2(answer_fd, first++);
+      channel->memory_fd = -1;
+    }
+    if(close_range(first, ~0U, 0) != 0){
+      for(int fd = first; fd < sysconf(_SC_OPEN_MAX); fd++) close(fd);
+    }
+    engineProcess(startup_location, renderer->socket_path, channel);
+    _exit(0);
+  }
+  if(pid < 0) fprintf(stderr, "Fork of renderer %s failed %s\n", renderer->socket_path, strerror(errno));
+  renderer->pid = pid;
+  renderer->started = monotonic_millis();
+}
+
+// Supervisor process forked by main before any thread or socket exists. It forks the
+// renderers and forks each again when it exits, after renderer_restart_delay doubled
+// for every exit in a row that came within renderer_stable_after of the start.
+// The server reconnects to the new renderer on its own
+static void supervise_renderers(vector<renderer_process*>* renderers, const char* startup_location, int server){
+  prctl(PR_SET_PDEATHSIG, SIGTERM); // renderers follow through their own death signal
+  if(getppid() != server) _exit(0);
+  sigset_t children;
+  sigemptyset(&children);
+  sigaddset(&children, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &children, NULL); // waited for with sigtimedwait
+  for(auto renderer : *renderers){
+    renderer->failures = 0;
+    spawn_renderer(renderer, startup_location);
+  }
+
+  while(true){
+    uint64_t now = monotonic_millis();
+    int status;
+    int pid;
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+      for(auto renderer : *renderers){
+        if(renderer->pid != pid) continue;
+        if(WIFSIGNALED(status)) fprintf(stderr, "Renderer %s killed by signal %d\n", renderer->socket_path, WTERMSIG(status));
+        else fprintf(stderr, "Renderer %s exited with status %d\n", renderer->socket_path, WEXITSTATUS(status));
+        renderer->failures = now - renderer->started < (uint64_t) renderer_stable_after ? renderer->failures + 1 : 0;
+        long delay = renderer_restart_delay;
+        for(int i = 1; i < renderer->failures && delay < renderer_max_restart_delay; i++) delay *= 2;
+        renderer->pid = 0;
+        renderer->restart_at = now + min(delay, renderer_max_restart_delay);
+      }
+    }
+
+    long wait = renderer_max_restart_delay;
+    for(auto renderer : *renderers){
+      if(renderer->pid > 0) continue;
+      if(renderer->pid == 0 && renderer->restart_at > now){
+        wait = min(wait, (long) (renderer->restart_at - now));
+        continue;
+      }
+      spawn_renderer(renderer, startup_location);
+      if(renderer->pid < 0) wait = min(wait, renderer_restart_delay); // fork failed, try again
+    }
+    struct timespec timeout = {wait / 1000, (wait % 1000) * 1000000};
+    sigtimedwait(&children, NULL, &timeout);
+  }
+}
+
+// answer a request whose render failed or passed its deadline
+static void send_fallback(balancer_job job, int status){
+  job->setResponseStatus(status);
+  job->sendResponse(fallback_page);
+}
+
+// rendered page shared by the requests of a coalesced render, freed by the last writer
+typedef struct shared_render{
+  char* base;
+  body_release_cb release; // of the frame or ring record holding the page
+  void* hint;
+  AtomicInt refs;
+}shared_render;
+
+static void release_shared_render(char* base, void* hint){
+  shared_render* render = (shared_render*) hint;
+  if(render->refs.decrement_get() > 0) return;
+  render->release(render->base, render->hint);
+  delete render;
+}
 
 typedef struct job_binder{
   HttpData* data;
-  uv_pipe_t* pipe;
-  uv_buf_t url;
+  uint32_t id; // request id of the frame sent to the renderer
+  string key; // coalesced render the job leads, empty when it is not shared
+  uint64_t sent; // monotonic ms the job was given to the renderer
 }job_binder;
 
 typedef struct BalancerWorker{
     uv_loop_t* loop;
     uv_pipe_t pipe;
-    const char* socket_path;
-    job_binder* current_job;
+    uv_connect_t connect;
+    renderer_process* renderer;
     uv_async_t async_write;
+    uv_timer_t restart_timer; // reconnects to the renderer after its pipe is lost
+    Balancer* balancer;
+    ipc::frame_assembler frames;
+    uv_poll_t answer_poll;
+    bool alive; // false from the loss of the pipe until the renderer is connected again
+    bool pipe_closed;
+    uint64_t ring_fallbacks; // frames that went over the pipe because a ring was full, balancer loop only
     mutable std::mutex* guard;
 
-    BalancerWorker(const char* _socket_path){
-      current_job = NULL;
+    // jobs sent to the renderer and not answered yet, keyed by request id,
+    // up to renderer_pipeline_depth so the renderer has its next job queued
+    unordered_map<uint32_t, job_binder*> in_flight;
+    vector<job_binder*> outbox; // jobs to be written by the balancer loop
+    uint32_t next_id;
+    double latency; // moving average of render times in ms, 0 until the first render
+    uint64_t last_answer; // monotonic ms of the last answer, the next render started no earlier
+
+    BalancerWorker(renderer_process* _renderer){
+      renderer = _renderer;
+      alive = true;
+      pipe_closed = false;
+      ring_fallbacks = 0;
+      next_id = 0;
+      latency = 0;
+      last_answer = 0;
       guard = new mutex;
+      in_flight.reserve(renderer_pipeline_depth * 2);
     };
     ~BalancerWorker(){};
 
     bool process(balancer_job job){
       std::lock_guard<std::mutex> lock(*guard);
-      if(current_job != NULL) return false;
+      if(!alive || in_flight.size() >= (size_t) renderer_pipeline_depth) return false;
       job_binder* binder = new job_binder;
       binder->data = job;
-      binder->pipe = &pipe;
-      async_write.data = binder;
-      current_job = binder;
+      binder->id = next_id++;
+      binder->sent = monotonic_millis();
+      if(job->coalesce) binder->key = job->coalesceKey();
+      in_flight[binder->id] = binder;
+      outbox.push_back(binder);
       uv_async_send(&async_write);
       return true;
     }
 
+    int outstanding(){
+      std::lock_guard<std::mutex> lock(*guard);
+      return in_flight.size();
+    }
+
     bool isWorking(){
+      return outstanding() > 0;
+    }
+
+    // account the render time of a job sent at sent and answered at now. Jobs are rendered
+    // in order, so the render started when the job was sent or when the previous one was
+    // answered, the wait behind queued jobs is not counted
+    void record_latency(uint64_t sent, uint64_t now){
+      std::lock_guard<std::mutex> lock(*guard);
+      double ms = now - max(sent, last_answer);
+      last_answer = now;
+      latency = latency == 0 ? ms : latency + latency_ewma_weight * (ms - latency);
+    }
+
+    // expected wait of a new job, lower is better, a render counts at least 1ms
+    double load(){
+      std::lock_guard<std::mutex> lock(*guard);
+      return (in_flight.size() + 1) * max(latency, 1.0);
+    }
+
+    vector<job_binder*> takeOutbox(){
+      std::lock_guard<std::mutex> lock(*guard);
+      vector<job_binder*> jobs;
+      jobs.swap(outbox);
+      return jobs;
+    }
+
+    // pipe to the renderer is lost, no new jobs until set_alive
+    void stop(){
+      std::lock_guard<std::mutex> lock(*guard);
+      alive = false;
+    }
+
+    void set_alive(){
       std::lock_guard<std::mutex> lock(*guard);
-      return current_job !=NULL;
+      alive = true;
     }
 
-    void reset(){
+    bool isAlive(){
       std::lock_guard<std::mutex> lock(*guard);
-      current_job = NULL;
+      return alive;
+    }
+
+    // every job left unanswered by a lost renderer, oldest first
+    vector<job_binder*> takeJobs(){
+      std::lock_guard<std::mutex> lock(*guard);
+      vector<job_binder*> jobs;
+      for(auto &it : in_flight) jobs.push_back(it.second);
+      in_flight.clear();
+      outbox.clear(); // its jobs are also in flight
+      sort(jobs.begin(), jobs.end(), [](job_binder* a, job_binder* b){
+        return a->sent != b->sent ? a->sent < b->sent : a->id < b->id;
+      });
+      return jobs;
+    }
+
+    // job answered by the renderer, NULL for an unknown id
+    job_binder* complete(uint32_t id){
+      std::lock_guard<std::mutex> lock(*guard);
+      auto it = in_flight.find(id);
+      if(it == in_flight.end()) return NULL;
+      job_binder* binder = it->second;
+      in_flight.erase(it);
+      return binder;
+    }
+
+    // detach the requests of jobs past their deadline, a job keeps its slot
+    // until the renderer answers and that late answer is dropped
+    vector<balancer_job> expire(uint64_t now){
+      std::lock_guard<std::mutex> lock(*guard);
+      vector<balancer_job> expired;
+      for(auto &it : in_flight){
+        job_binder* binder = it.second;
+        if(binder->data == NULL || binder->data->deadline > now) continue;
+        expired.push_back(binder->data);
+        binder->data = NULL;
+      }
+      return expired;
     }
 
 } BalancerWorker;
 
 
+// Choose the renderer a job is given to, the job goes to the next renderers
+// in order when the chosen one has no free slot. Called under the balancer lock
+class WorkerPolicy{
+  public:
+    virtual ~WorkerPolicy(){};
+    virtual int pick(const vector<BalancerWorker*> &workers) = 0;
+};
+
+// every renderer in turn
+class RoundRobinPolicy : public WorkerPolicy{
+  private:
+    RoundRobin robin;
+  public:
+    RoundRobinPolicy(int count) : robin(count) {};
+
+    int pick(const vector<BalancerWorker*> &workers){
+      return robin.get();
+    }
+};
+
+// renderer with the fewest jobs in flight
+class LeastOutstandingPolicy : public WorkerPolicy{
+  public:
+    int pick(const vector<BalancerWorker*> &workers){
+      int best = 0;
+      int best_count = INT_MAX;
+      for(size_t i=0; i<workers.size(); i++){
+        int count = workers[i]->outstanding();
+        if(count < best_count){
+          best = i;
+          best_count = count;
+        }
+      }
+      return best;
+    }
+};
+
+// power of two choices : the less loaded of two random renderers, load weighs
+// the jobs in flight by the render latency so a renderer slowed by GC or heavy routes gets less
+class LatencyPolicy : public WorkerPolicy{
+  private:
+    unsigned int seed;
+  public:
+    LatencyPolicy(){
+      seed = time(NULL);
+    };
+
+    int pick(const vector<BalancerWorker*> &workers){
+      int count = workers.size();
+      if(count == 1) return 0;
+      int a = rand_r(&seed) % count;
+      int b = (a + 1 + rand_r(&seed) % (count - 1)) % count;
+      return workers[a]->load() <= workers[b]->load() ? a : b;
+    }
+};
+
+static WorkerPolicy* create_policy(const char* name, int count){
+  if(strcmp(name, "least_outstanding") == 0) return new LeastOutstandingPolicy();
+  if(strcmp(name, "p2c_latency") == 0) return new LatencyPolicy();
+  if(strcmp(name, "round_robin") != 0) fprintf(stderr, "Unknown worker policy %s, using round_robin\n", name);
+  return new RoundRobinPolicy(count);
+}
+
+
 class Balancer : public Thread{
   private:
     uv_loop_t* UV_LOOP;
     uv_async_t holder;
     uv_timer_t checker;
-    vector<const char*>* sockets;
+    uv_timer_t deadline_checker;
+    vector<renderer_process*>* renderers;
     vector<BalancerWorker*> workers;
     TQueue<balancer_job> pending;
     int worker_count;
     synchronizer* sync;
-    RoundRobin robin;
+    WorkerPolicy* policy;
     mutable std::mutex* guard;
 
+    SharedBufferPool* frame_pool; // answers of every renderer are read into these buffers
+
+    // requests waiting on the in-flight render of the same page, keyed by render key,
+    // the request being rendered is not in the list
+    unordered_map<string, vector<balancer_job>> coalesced;
+    mutable std::mutex* flight_guard;
+
   public:
-    Balancer(vector<const char*>* _sockets){
-      sockets = _sockets;
+    Balancer(vector<renderer_process*>* _renderers){
+      renderers = _renderers;
       sync = new synchronizer();
       guard = new mutex;
-      robin.set_limit(_sockets->size());
+      flight_guard = new mutex;
+      frame_pool = new SharedBufferPool(frame_buffer_size, frame_pool_size);
+      worker_count = 0;
+      policy = create_policy(worker_policy, _renderers->size());
     };
     ~Balancer(){
       delete sync;
+      delete policy;
       delete guard;
+      delete flight_guard;
+      delete frame_pool;
     };
 
-    // use lock coz it might be called either from the event loop
-    // or from the http server thread
+    // identical requests wait on the render already in flight instead of rendering again
     void load_balance(balancer_job job){
-      std::lock_guard<std::mutex> lock(*guard);
-      // if only single worker, why load balance??
-      if(worker_count == 1){
-        if(!workers[0]->process(job)){
-          pending.push(job);
+      if(job->coalesce){
+        string key = job->coalesceKey(); // a personalized page is never shared
+        std::lock_guard<std::mutex> lock(*flight_guard);
+        auto group = coalesced.find(key);
+        if(group != coalesced.end()){
+          group->second.push_back(job);
+          return;
         }
+        coalesced.emplace(key, vector<balancer_job>());
       }
+      dispatch(job);
+    }
 
-      // use round robin 'skip-if-busy' algorithm
-      else {
-        int x;
-        bool is_process = false;
-        for(int i=0; i<worker_count; i++){
-          x = robin.get();
-          is_process = workers[x]->process(job);
-          if(is_process) break;
-        }
-        if(!is_process) pending.push(job);
+    // use lock coz it might be called either from the event loop
+    // or from the http server thread
+    void dispatch(balancer_job job){
+      if(answer_expired(job)) return;
+
+      std::lock_guard<std::mutex> lock(*guard);
+      // start from the renderer chosen by the policy, skip the busy ones
+      int first = worker_count == 1 ? 0 : policy->pick(workers);
+      bool is_process = false;
+      for(int i=0; i<worker_count; i++){
+        is_process = workers[(first + i) % worker_count]->process(job);
+        if(is_process) break;
       }
+      if(!is_process) pending.push(job);
 
       // int pending_count = pending->count();
       // printf("Pending count : %d\n", pending_count);
@@ -115,6 +424,130 @@ class Balancer : public Thread{
       return &pending;
     }
 
+    // waited in the queue past its deadline
+    bool answer_expired(balancer_job job){
+      if(job->deadline > monotonic_millis()) return false;
+      if(job->coalesce) promote(job->coalesceKey());
+      send_fallback(job, 504);
+      return true;
+    }
+
+    // worker w just became free, give it the oldest pending job right away,
+    // check_pending_queue only picks up what is missed here
+    void hand_off(BalancerWorker* w){
+      balancer_job job;
+      while(pending.tryTake(job)){
+        if(answer_expired(job)) continue;
+        if(!w->process(job)) dispatch(job); // taken meanwhile by a new request
+        return;
+      }
+    }
+
+    // render of key is done, hand back the requests that waited on it
+    vector<balancer_job> complete(const string &key){
+      std::lock_guard<std::mutex> lock(*flight_guard);
+      vector<balancer_job> waiting;
+      auto group = coalesced.find(key);
+      if(group == coalesced.end()) return waiting;
+      waiting.swap(group->second);
+      coalesced.erase(group);
+      return waiting;
+    }
+
+    // render of key was never sent, the oldest waiting request renders instead
+    void promote(const string &key){
+      balancer_job next;
+      {
+        std::lock_guard<std::mutex> lock(*flight_guard);
+        auto group = coalesced.find(key);
+        if(group == coalesced.end()) return;
+        if(group->second.empty()){
+          coalesced.erase(group);
+          return;
+        }
+        next = group->second.front();
+        group->second.erase(group->second.begin());
+      }
+      dispatch(next);
+    }
+
+    // answer requests whose render passed the deadline with the fallback page
+    void expire_jobs(){
+      uint64_t now = monotonic_millis();
+      for(auto w : workers){
+        for(auto job : w->expire(now)) send_fallback(job, 504);
+      }
+
+      vector<balancer_job> expired;
+      {
+        std::lock_guard<std::mutex> lock(*flight_guard);
+        for(auto &group : coalesced){
+          vector<balancer_job> &waiting = group.second;
+          for(auto it = waiting.begin(); it != waiting.end();){
+            if((*it)->deadline > now){ ++it; continue; }
+            expired.push_back(*it);
+            it = waiting.erase(it);
+          }
+        }
+      }
+      for(auto job : expired) send_fallback(job, 504);
+    }
+
+    // The pipe of w reached its end or failed, the renderer exited or dropped the connection.
+    // Every answer it sent has been read by now, answers still in its ring are read too,
+    // so the oldest unanswered job was being rendered and is the likely cause : it and the
+    // requests sharing its render get the fallback page, the others go to the remaining
+    // renderers. The supervisor forks a renderer that exited, restart_renderer reconnects
+    void renderer_lost(BalancerWorker* w){
+      if(!w->isAlive()) return;
+      fprintf(stderr, "Lost renderer %s\n", w->renderer->socket_path);
+      w->stop();
+      if(w->renderer->channel != NULL) read_shm_answers(w);
+      if(!uv_is_closing((uv_handle_t*) &w->pipe)) uv_close((uv_handle_t*) &w->pipe, on_pipe_closed);
+      redispatch(w, true);
+      uv_timer_start(&w->restart_timer, restart_renderer, renderer_restart_delay, renderer_restart_delay);
+    }
+
+    // give the unanswered jobs of w to the other renderers, when the renderer crashed
+    // the oldest job and the requests sharing its render get the fallback page instead
+    void redispatch(BalancerWorker* w, bool crashed){
+      vector<job_binder*> jobs = w->takeJobs();
+      for(size_t i=0; i<jobs.size(); i++){
+        job_binder* binder = jobs[i];
+        if(i == 0 && crashed){
+          if(binder->data != NULL) send_fallback(binder->data, 502);
+          if(!binder->key.empty()){
+            for(auto job : complete(binder->key)) send_fallback(job, 502);
+          }
+        }
+        else if(binder->data != NULL) dispatch(binder->data); // still leads its coalesced render
+        else if(!binder->key.empty()) promote(binder->key);
+        delete binder;
+      }
+    }
+
+    // pipe of w could not connect, its renderer is alive but not listening yet
+    void disconnected(BalancerWorker* w){
+      w->stop();
+      if(!uv_is_closing((uv_handle_t*) &w->pipe)) uv_close((uv_handle_t*) &w->pipe, on_pipe_closed);
+      redispatch(w, false);
+      uv_timer_start(&w->restart_timer, restart_renderer, renderer_restart_delay, renderer_restart_delay);
+    }
+
+    // try to connect w to its renderer again, called until the renderer listens
+    void reconnect(BalancerWorker* w){
+      if(!w->pipe_closed) return;
+      w->pipe_closed = false;
+      // the renderer reads requests only once connected, requests left in the ring were
+      // failed over and one it read without releasing would hold the ring forever
+      if(w->renderer->channel != NULL) w->renderer->channel->resetRequests();
+      uv_pipe_init(UV_LOOP, &w->pipe, 0);
+      w->pipe.data = w;
+      w->connect.data = w;
+      uv_pipe_connect(&w->connect, &w->pipe, w->renderer->socket_path, on_pipe_connect);
+      uv_timer_stop(&w->restart_timer);
+    }
+
     void startup(){
       this->start_detached();
     }
@@ -127,23 +560,38 @@ class Balancer : public Thread{
       UV_LOOP = uv_loop_new();
 
       // UNIX-SOCKET process connection
-      for(auto socket_path : *sockets){
-        BalancerWorker* worker = new BalancerWorker(socket_path);
+      for(auto renderer : *renderers){
+        const char* socket_path = renderer->socket_path;
+        BalancerWorker* worker = new BalancerWorker(renderer);
         worker->loop = UV_LOOP;
+        worker->balancer = this;
+        worker->frames.pool = frame_pool;
         uv_status("Pipe Initialization", uv_pipe_init(UV_LOOP, &worker->pipe, 0));
-        uv_connect_t connect;
         worker->pipe.data = worker;
         uv_status("Pipe Open", uv_pipe_open(&worker->pipe, socket(PF_UNIX, SOCK_STREAM, 0)));
-        connect.data = (void*)socket_path;
-        uv_pipe_connect(&connect, &worker->pipe, socket_path, on_pipe_connect);
+        worker->connect.data = worker;
+        uv_pipe_connect(&worker->connect, &worker->pipe, socket_path, on_pipe_connect);
         uv_async_init(UV_LOOP, &worker->async_write, async_pipe_write);
+        worker->async_write.data = worker;
+        uv_timer_init(UV_LOOP, &worker->restart_timer);
+        worker->restart_timer.data = worker;
+        if(renderer->channel != NULL){
+          uv_poll_init(UV_LOOP, &worker->answer_poll, renderer->channel->answer_fd);
+          worker->answer_poll.data = worker;
+          uv_poll_start(&worker->answer_poll, UV_READABLE, on_shm_answer);
+        }
         workers.insert(workers.end(), worker);
         worker_count++;
       }
-      // Initialize timer to check pending queue
+      // Initialize timer to check pending queue, pending jobs are normally handed off
+      // to the worker that finishes a render, the timer only catches what is missed
       uv_timer_init(UV_LOOP, &checker);
       checker.data = this;
       uv_timer_start(&checker, (uv_timer_cb) check_pending_queue, 4000, 250);
+      // Initialize timer to abandon renders past their deadline
+      uv_timer_init(UV_LOOP, &deadline_checker);
+      deadline_checker.data = this;
+      uv_timer_start(&deadline_checker, check_deadlines, deadline_check_interval, deadline_check_interval);
       // init loop
       sync->notify_all();
       println("Balancer Started");
@@ -151,67 +599,184 @@ class Balancer : public Thread{
     }
 };
 
-// timer to check pending queue that is left when renderer process is busy
+// safety net for pending jobs that were not handed off when a worker became free
 static void check_pending_queue (uv_timer_t* timer, int status) {
   Balancer* bal = static_cast<Balancer*>(timer->data);
   TQueue<balancer_job>* pending = bal->get_pending();
   int count = pending->count();
   if(count == 0) return; // return if no pending
   for(int i=0; i<count; i++){
-    bal->load_balance(pending->take());
+    bal->dispatch(pending->take());
   }
 }
 
-// called upon new unix socket connection
+// timer to abandon renders past their deadline
+static void check_deadlines (uv_timer_t* timer) {
+  Balancer* bal = static_cast<Balancer*>(timer->data);
+  bal->expire_jobs();
+}
+
+// called upon new unix socket connection, answers are read for as long as the pipe is open
 static void on_pipe_connect(uv_connect_t* connect, int status){
-  printf("Connected to %s\n", (const char*)connect->data);
-  uv_status("CONNECT", status);
+  BalancerWorker* w = (BalancerWorker*) connect->data;
+  if(status < 0){
+    fprintf(stderr, "Connect to %s failed %s, retrying\n", w->renderer->socket_path, uv_err_name(status));
+    w->balancer->disconnected(w);
+    return;
+  }
+  printf("Connected to %s\n", w->renderer->socket_path);
+  uv_read_start((uv_stream_t*) &w->pipe, frame_alloc, on_ipc_read);
+  w->set_alive();
+  w->balancer->hand_off(w);
+}
+
+// pipe of w is closed, it can be connected again
+static void on_pipe_closed(uv_handle_t* handle){
+  BalancerWorker* w = (BalancerWorker*) handle->data;
+  w->pipe_closed = true;
+  w->frames.reset(); // a frame cut by the close is never completed
 }
 
+static void restart_renderer(uv_timer_t* timer){
+  BalancerWorker* w = (BalancerWorker*) timer->data;
+  w->balancer->reconnect(w);
+}
+
+// a frame went over the pipe while w has rings, logged when the count doubles
+// so a ring pinned by slow readers shows up without flooding the log
+static void count_ring_fallback(BalancerWorker* w, const char* ring){
+  w->ring_fallbacks++;
+  if((w->ring_fallbacks & (w->ring_fallbacks - 1)) == 0){
+    fprintf(stderr, "%s ring of %s full, %llu frames sent over the pipe\n", ring, w->renderer->socket_path, (unsigned long long) w->ring_fallbacks);
+  }
+}
+
+// write every job queued by process, each as one request frame
+// into the request ring, or over the pipe when the ring is full
 static void async_pipe_write(uv_async_t *handle){
-  job_binder* binder = (job_binder*)(handle->data);
-  binder->url = {
-    .base = CharCopy(binder->data->request_url.c_str()), 
-    .len = binder->data->request_url.length()
-  };
-  uv_write_t *_write = (uv_write_t *) malloc(sizeof(uv_write_t));
-  _write->data = binder;
-  uv_write(_write, (uv_stream_t *) binder->pipe, &binder->url, 1, on_ipc_write);
+  BalancerWorker* w = (BalancerWorker*) handle->data;
+  bool notify = false;
+  for(job_binder* binder : w->takeOutbox()){
+    if(binder->data == NULL){ // expired before it was sent
+      w->complete(binder->id);
+      string key = binder->key;
+      delete binder;
+      if(!key.empty()) w->balancer->promote(key);
+      w->balancer->hand_off(w);
+      continue;
+    }
+    string payload = binder->data->renderRequest(); // url and forwarded headers
+    if(w->renderer->channel != NULL && w->renderer->channel->requests->write(binder->id, payload.data(), payload.length())){
+      notify = true;
+      continue;
+    }
+    if(w->renderer->channel != NULL) count_ring_fallback(w, "Request");
+    ipc::frame_write* write = new ipc::frame_write;
+    write->payload = std::move(payload);
+    write->header = {binder->id, (uint32_t) write->payload.length()};
+    write->bufs[0] = {.base = (char*) &write->header, .len = sizeof(ipc::frame_header)};
+    write->bufs[1] = {.base = (char*) write->payload.data(), .len = write->payload.length()};
+    write->req.data = w;
+    if(uv_write(&write->req, (uv_stream_t *) &w->pipe, write->bufs, 2, on_ipc_write) != 0) delete write; // pipe closed, the job is failed over
+  }
+  if(notify) ShmChannel::notify(w->renderer->channel->request_fd);
 }
 
 static void on_ipc_write(uv_write_t* req, int status){
-  job_binder* binder = (job_binder*)(req->data);
-  if(binder==NULL) println("BINDER IS NULL HERE");
-  // no free here, it will be done after reading data from child process
-  if (status < 0) {
+  BalancerWorker* w = (BalancerWorker*) req->data;
+  if (status < 0 && !uv_is_closing((uv_handle_t*) &w->pipe)) {
     fprintf(stderr, "IPC Write error %s\n", uv_err_name(status));
-    uv_close((uv_handle_t*) binder->pipe, NULL);
+    w->balancer->renderer_lost(w);
+  }
+  delete (ipc::frame_write*) req;
+}
+
+// answer of the renderer to request id, payload is handed to the responses without copy
+// and given back with release once every response is written
+static void on_render_frame(BalancerWorker* w, uint32_t id, char* payload, size_t length, body_release_cb release, void* hint){
+  job_binder* binder = w->complete(id);
+  if(binder == NULL){
+    fprintf(stderr, "IPC answer to unknown request %u\n", id);
+    release(payload, hint);
+    return;
+  }
+  w->record_latency(binder->sent, monotonic_millis());
+
+  // data is NULL when the request was already answered after its deadline
+  vector<balancer_job> jobs;
+  if(binder->data != NULL) jobs.push_back(binder->data);
+  if(!binder->key.empty()){ // requests that waited on this render get the same page
+    vector<balancer_job> waiting = w->balancer->complete(binder->key);
+    jobs.insert(jobs.end(), waiting.begin(), waiting.end());
+  }
+
+  size_t marker_len = strlen(render_fallback_marker);
+  if(jobs.empty()){ // nobody is waiting for this page anymore
+    release(payload, hint);
+  }
+  else if(length >= marker_len && memcmp(payload, render_fallback_marker, marker_len) == 0){
+    release(payload, hint);
+    for(auto job : jobs) send_fallback(job, 503); // render was terminated by the renderer watchdog
   }
-  else {
-    uv_read_start((uv_stream_t*)binder->pipe, alloc_buffer, on_ipc_read);
+  else if(jobs.size() == 1){
+    if(enable_etag) jobs[0]->setBodyHash(hash64(payload, length));
+    jobs[0]->sendResponse(payload, length, release, hint); // page is released once written
   }
-  req->data = NULL;
-  free(req);
+  else { // page is shared and released once every response is written
+    shared_render* render = new shared_render;
+    render->base = payload;
+    render->release = release;
+    render->hint = hint;
+    render->refs.set(jobs.size());
+    uint64_t hash = enable_etag ? hash64(payload, length) : 0; // one ETag for the render
+    for(auto job : jobs){
+      if(enable_etag) job->setBodyHash(hash);
+      job->sendResponse(payload, length, release_shared_render, render);
+    }
+  }
+  delete binder;
+  w->balancer->hand_off(w);
+}
+
+// answers are read straight into the frame being assembled
+static void frame_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf){
+  BalancerWorker* w = (BalancerWorker*) handle->data;
+  w->frames.alloc(buf);
 }
 
 static void on_ipc_read(uv_stream_t* pipe, ssize_t nread, const uv_buf_t* buf) {
+  BalancerWorker* w = (BalancerWorker*) pipe->data;
   if (nread > 0) {
-    BalancerWorker* w = (BalancerWorker*) pipe->data;
-    job_binder* binder = w->current_job;
-    if(binder == NULL) println("NO BINDER!!");
-    HttpData* data = binder->data;
-    data->sendResponse(buf->base);
-    free(binder->url.base);
-    delete binder;
-    w->reset();
-  } else {
+    bool valid = w->frames.consume(nread, [w](uint32_t id, char* payload, size_t length, void* pool){
+      if(w->renderer->channel != NULL) count_ring_fallback(w, "Answer");
+      on_render_frame(w, id, payload, length, ipc::release_frame, pool);
+    });
+    if (!valid && !uv_is_closing((uv_handle_t*)pipe)) {
+      fprintf(stderr, "IPC invalid frame from %s\n", w->renderer->socket_path);
+      w->balancer->renderer_lost(w);
+    }
+  } else if (nread < 0 && !uv_is_closing((uv_handle_t*)pipe)) {
     if (nread != UV_EOF)
       fprintf(stderr, "IPC Handle re-Read error %s\n", uv_err_name(nread));
-    uv_close((uv_handle_t*)pipe, NULL);
+    w->balancer->renderer_lost(w); // every answer on the pipe has been read
   }
-  free(buf->base);
 };
 
+// answers in the ring are sent from there, a record is released once its responses are written
+static void on_shm_answer(uv_poll_t* handle, int status, int events){
+  BalancerWorker* w = (BalancerWorker*) handle->data;
+  if(status < 0 || w->renderer->channel == NULL) return;
+  ShmChannel::drain(w->renderer->channel->answer_fd);
+  read_shm_answers(w);
+}
+
+static void read_shm_answers(BalancerWorker* w){
+  shm_record* record;
+  while((record = w->renderer->channel->answers->next()) != NULL){
+    on_render_frame(w, record->id, (char*) record + sizeof(shm_record), record->length, release_shm_answer, w->renderer->channel);
+  }
+}
+
 static void http_server_test_case(){
   HttpServer server([](HttpData* req){
     req->setResponseStatus(200);
@@ -226,44 +791,54 @@ static void http_server_test_case(){
 
 // main function
 int main(int argc, char* argv[]) {
-  vector<const char*>* sockets = new vector<const char*>;
-  int pid;
+  vector<renderer_process*>* renderers = new vector<renderer_process*>;
   
   for(int i=0; i<num_process; i++){
-    char* socket_path = str_format("/tmp/v8_process%d.sock", i);
-    unlink(socket_path);
-    pid = fork();
-    if(pid == 0){ // forked process
-      engineProcess(argv[0], socket_path);
-    } else { // main process
-      sockets->insert(sockets->end(), socket_path);
+    renderer_process* renderer = new renderer_process;
+    renderer->socket_path = str_format("/tmp/v8_process%d.sock", i);
+    // rings are mapped before fork so both processes share them
+    renderer->channel = NULL;
+    if(enable_shm_transport){
+      renderer->channel = new ShmChannel(shm_ring_size);
+      if(!renderer->channel->isOpen()){
+        fprintf(stderr, "Shared memory transport unavailable for %s\n", renderer->socket_path);
+        renderer->channel = NULL;
+      }
     }
+    renderers->insert(renderers->end(), renderer);
   } 
 
-  if(pid!=0){
-    println("starting http server");
-    sleep(4);
-    static Balancer bal = Balancer(sockets);
-    bal.startup();
-    bal.wait_startup();
-
-    HttpServer server([](HttpData* req){
-      req->setResponseStatus(200);
-      req->setResponseHeader("Connection", "keep-alive");
-      req->setResponseHeader("Transfer-Encoding", "chunked");
-
-      if(req->request_url == "/favicon.ico"){
-        req->setResponseHeader("Content-Type", "image/vnd.microsoft.icon");
-        req->sendResponse(" ");
-      }else{
-        req->setResponseHeader("Content-Type", "text/html");
-        bal.load_balance(req);
-      }
-      
-    });
-    server.cache_url.add("/page1","/page2","/itemgrid");
-    server.listen("0.0.0.0", 8000);
+  // renderers are forked by a supervisor, the server threads and sockets are not inherited
+  int server_pid = getpid();
+  int supervisor = fork();
+  if(supervisor == 0) supervise_renderers(renderers, argv[0], server_pid);
+  if(supervisor < 0){
+    fprintf(stderr, "Fork of the renderer supervisor failed %s\n", strerror(errno));
+    return 1;
   }
+
+  println("starting http server");
+  sleep(4);
+  static Balancer bal = Balancer(renderers);
+  bal.startup();
+  bal.wait_startup();
+
+  HttpServer server([](HttpData* req){
+    req->setResponseStatus(200);
+    req->setResponseHeader("Connection", "keep-alive");
+    req->setResponseHeader("Transfer-Encoding", "chunked");
+    req->setResponseHeader("Content-Type", "text/html");
+    bal.load_balance(req);
+  });
+  if(!server.cache_url.load(cache_rules_path)) server.cache_url.add("/page1","/page2","/itemgrid");
+  if(enable_cache && enable_disk_cache){ // pages of another bundle are never served
+    string bundle = LoadScript();
+    server.persist_cache(disk_cache_path, hash64(bundle.data(), bundle.length()));
+  }
+  if(enable_cache) server.warm_up(warm_up_path);
+  server.serve_static("/assets/", "/var/www/html/assets/");
+  server.serve_static("/favicon.ico", "/var/www/html/favicon.ico");
+  server.listen("0.0.0.0", 8000);
   
   return 0;
-}
\ No newline at end of file
+}
@@ -1,4 +1,6 @@
 #include "components.h"
+#include "disk_cache.h"
+#include "shm_ring.h"
 
 // Unix Socket Includes
 #include <sys/socket.h>
@@ -11,6 +13,8 @@ static void http_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t* buf);
 static void http_on_connect(uv_stream_t* handle, int status);
 static void async_callback(uv_async_t *handle);
 static void on_write_end(uv_write_t* response, int status);
+static void on_idle_timeout(uv_timer_t* timer);
+static void on_connection_closed(void* server);
 
 static inline void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
   buf->base = (char*)malloc(suggested_size);
@@ -23,35 +27,342 @@ static inline void free_async_handle(uv_async_t* handle){
   uv_close((uv_handle_t*)handle, NULL); // close async handle immediately
 }
 
+// Give a borrowed response body back to its producer once it has been written
+typedef void (*body_release_cb)(char* base, void* hint);
+
+static void free_body(char* base, void* hint){
+  free(base);
+}
+
+// Request header, key and value are offsets into the request header arena
+typedef struct header_entry {
+  uint32_t key;
+  uint32_t key_len;
+  uint32_t value;
+  uint32_t value_len;
+} header_entry;
+
+// Compress data with zlib, gzip and deflate only differ by the stream wrapper
+static bool compress_body(const char* data, size_t len, int encoding, int level, string* out){
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  int window_bits = encoding == encoding_gzip ? 15 + 16 : 15;
+  if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+  out->resize(deflateBound(&stream, len));
+  stream.next_in = (Bytef*) data;
+  stream.avail_in = len;
+  stream.next_out = (Bytef*) &(*out)[0];
+  stream.avail_out = out->size();
+
+  int status = deflate(&stream, Z_FINISH);
+  out->resize(stream.total_out);
+  deflateEnd(&stream);
+  return status == Z_STREAM_END;
+}
+
+static const char* encoding_names[encoding_count] = {"identity", "gzip", "deflate"};
+
+// Reason phrase of the status line
+static const char* status_text(int status){
+  switch(status){
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "OK";
+  }
+}
+
+static const string chunk_terminator = "0" + CRLF + CRLF;
+static const string last_chunk = CRLF + chunk_terminator;
+
 // Integrated Http Request and Response
 typedef struct _HttpData {
-  uv_buf_t resBuf;
+  wire_buffer cached; // cached response being written, shared with the page cache
   uv_async_t async;
   uv_tcp_t handle;
+  uv_timer_t idle_timer;
+
+  // parser lives as long as the connection so requests can span several reads,
+  // bytes of pipelined requests are kept until the current response is written
+  http_parser request_parser;
+  string pending_input;
 
   string request_url;
   ostringstream request_body;
   string request_method;
 
+  // request headers are copied into one arena allocated with the wrapper,
+  // entries point into the arena so nothing else is allocated per header
+  char* header_arena;
+  uint32_t arena_len;
+  vector<header_entry> request_headers;
+  bool parsing_value;
+
   int response_status;
   bool complete;
   void* server;
+  uint64_t deadline; // monotonic ms after which the render is abandoned
+
+  // response is written with a single uv_write of several buffers :
+  // header block (with chunk size line), borrowed body and chunk terminator
+  string header_block;
+  string body_owned;
+  uv_buf_t body;
+  body_release_cb release;
+  void* release_hint;
+  uv_buf_t bufs[3];
+  unsigned int nbufs;
+
+  // encoding accepted by the client and encoding applied to the response,
+  // compression runs on the libuv thread pool of the loop
+  int accept_encoding;
+  int response_encoding;
+  uv_work_t compress_work;
+  string compressed;
+
+  // static file sent with sendfile after the header block
+  struct static_file* file;
+  string file_path;
+  uv_file file_fd;
+  uv_fs_t fs_req;
+  int64_t file_offset;
+  size_t file_remaining;
+  long file_backoff; // ms before sendfile is tried again on a full socket, 0 after progress
+  long file_stalled; // ms waited on a full socket since the last progress
+
+  // connection state, a connection is reused for several requests when keep-alive
+  bool keep_alive;
+  bool in_flight;
+  bool closing;
+  int request_count;
+  int open_handles;
+  string etag; // of the response body, empty when the response has none
+  uint64_t body_hash; // hash64 of the uncompressed body when given by setBodyHash
+  bool body_hashed;
+  bool background; // revalidation or warm-up render without a client, only the async handle is open
+  bool warming; // background render of the cache warm-up
+  size_t warm_index; // warm-up render, url index * 2 + encoding
+  bool coalesce; // render may be shared with identical in-flight requests
+  bool shared; // page is cached under the url for every client, per-user headers are not forwarded
 
   map<const string, const string>* response_header;
 
   _HttpData(){
     complete = false;
+    keep_alive = false;
+    in_flight = false;
+    closing = false;
+    request_count = 0;
+    open_handles = 0;
+    background = false;
+    warming = false;
+    warm_index = 0;
+    coalesce = false;
+    shared = false;
+    body_hashed = false;
     response_header = new map<const string, const string>;
-    resBuf = {.base = NULL, .len = 0};
+    header_arena = (char*)malloc(max_request_header_size);
+    arena_len = 0;
+    parsing_value = false;
+    request_headers.reserve(32);
+    body = {.base = NULL, .len = 0};
+    release = NULL;
+    release_hint = NULL;
+    nbufs = 0;
+    accept_encoding = encoding_identity;
+    response_encoding = encoding_identity;
+    file = NULL;
   };
 
   ~_HttpData(){
+    release_body();
     response_header->clear();
     delete response_header;
-    free(resBuf.base);
+    free(header_arena);
   };
 
+  // hand the body back to whoever produced it
+  void release_body(){
+    if(release != NULL) release(body.base, release_hint);
+    release = NULL;
+    release_hint = NULL;
+    body = {.base = NULL, .len = 0};
+    body_owned.clear();
+    cached.reset();
+  }
+
+  // reset request and response state so the connection can serve the next request
+  void reset(){
+    request_url.clear();
+    request_body.str("");
+    request_body.clear();
+    request_method.clear();
+    arena_len = 0;
+    request_headers.clear();
+    parsing_value = false;
+    response_header->clear();
+    release_body();
+    header_block.clear();
+    compressed.clear();
+    nbufs = 0;
+    accept_encoding = encoding_identity;
+    response_encoding = encoding_identity;
+    complete = false;
+    keep_alive = false;
+    coalesce = false;
+    shared = false;
+    etag.clear();
+    body_hashed = false;
+  }
+
+  // reset connection state so the wrapper can be pooled and reused for another connection
+  void recycle(){
+    reset();
+    pending_input.clear();
+    server = NULL;
+    in_flight = false;
+    closing = false;
+    request_count = 0;
+    open_handles = 0;
+    background = false;
+    warming = false;
+  }
+
+  // copy what the renderer needs from another request, used for background renders
+  void copyRequest(_HttpData* from){
+    request_url = from->request_url;
+    request_method = from->request_method;
+    memcpy(header_arena, from->header_arena, from->arena_len);
+    arena_len = from->arena_len;
+    request_headers = from->request_headers;
+    accept_encoding = from->accept_encoding;
+  }
+
+  // append header bytes to the arena, fails when the headers are larger than the arena
+  bool add_header_bytes(const char* at, size_t length, bool is_value){
+    if(arena_len + length > (size_t) max_request_header_size) return false;
+    if(!is_value && (request_headers.empty() || parsing_value)){
+      request_headers.push_back({arena_len, 0, arena_len, 0}); // new field starts
+    }
+    if(request_headers.empty()) return false;
+    header_entry &h = request_headers.back();
+    if(is_value && !parsing_value) h.value = arena_len;
+    memcpy(header_arena + arena_len, at, length);
+    arena_len += length;
+    if(is_value) h.value_len += length;
+    else h.key_len += length;
+    parsing_value = is_value;
+    return true;
+  }
+
+  // case insensitive lookup of a request header
+  bool getRequestHeader(const char* key, const char** value, size_t* value_len){
+    size_t key_len = strlen(key);
+    for(header_entry &h : request_headers){
+      if(h.key_len == key_len && strncasecmp(header_arena + h.key, key, key_len) == 0){
+        *value = header_arena + h.value;
+        *value_len = h.value_len;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  string getRequestHeader(const char* key){
+    const char* value;
+    size_t value_len;
+    if(getRequestHeader(key, &value, &value_len)) return string(value, value_len);
+    return empty_string;
+  }
+
+  // request sent to the renderer : deadline and url on the first line then one forwarded
+  // header per line. The deadline is monotonic ms, the clock is the same in every process
+  string renderRequest(){
+    return to_string(deadline) + " " + renderKey();
+  }
+
+  // what the render depends on : url then one forwarded header per line,
+  // requests with the same key get the same page. Shared pages only get shared_forward_headers
+  string renderKey(){
+    string out = request_url;
+    if(shared) appendHeaders(out, shared_forward_headers);
+    else appendHeaders(out, forward_headers);
+    return out;
+  }
+
+  // in-flight requests with the same key share one render : the cache key (url) for shared
+  // pages, the render key where forwarded headers vary the page
+  string coalesceKey(){
+    return shared ? request_url : renderKey();
+  }
+
+  template<size_t N>
+  void appendHeaders(string& out, const char* (&keys)[N]){
+    const char* value;
+    size_t value_len;
+    for(const char* key : keys){
+      if(!getRequestHeader(key, &value, &value_len)) continue;
+      out.append("\n").append(key).append(": ").append(value, value_len);
+    }
+  }
+
+  // pick the encoding from Accept-Encoding, gzip is preferred over deflate
+  int negotiateEncoding(){
+    const char* value;
+    size_t value_len;
+    if(!getRequestHeader("Accept-Encoding", &value, &value_len)) return encoding_identity;
+
+    bool gzip = false, deflate = false;
+    const char* end = value + value_len;
+    while(value < end){
+      const char* token_end = (const char*) memchr(value, ',', end - value);
+      if(token_end == NULL) token_end = end;
+      while(value < token_end && *value == ' ') value++;
+      const char* name_end = (const char*) memchr(value, ';', token_end - value);
+      if(name_end == NULL) name_end = token_end;
+      size_t name_len = name_end - value;
+      while(name_len > 0 && value[name_len - 1] == ' ') name_len--;
+
+      // q=0 means not acceptable
+      string params(name_end, token_end - name_end);
+      params.erase(std::remove(params.begin(), params.end(), ' '), params.end());
+      bool refused = params.find("q=0") != string::npos && params.find_first_of("123456789", params.find("q=0")) == string::npos;
+
+      if(!refused && name_len == 4 && strncasecmp(value, "gzip", 4) == 0) gzip = true;
+      if(!refused && name_len == 7 && strncasecmp(value, "deflate", 7) == 0) deflate = true;
+      value = token_end + 1;
+    }
+    return gzip ? encoding_gzip : (deflate ? encoding_deflate : encoding_identity);
+  }
+
+  // only textual content is worth compressing
+  bool isCompressible(){
+    if(!enable_compression || !response_header->count("Content-Type")) return false;
+    const string &type = (*response_header)["Content-Type"];
+    return type.compare(0, 5, "text/") == 0
+      || type.find("json") != string::npos
+      || type.find("javascript") != string::npos
+      || type.find("xml") != string::npos;
+  }
+
+  bool needsCompression(){
+    return response_encoding != encoding_identity;
+  }
+
+  bool should_keep_alive(){
+    return keep_alive && !closing && request_count < max_keep_alive_requests;
+  }
+
   void setResponseHeader (const string key, const string val) {
+    response_header->erase(key);
     response_header->insert({ key, val });
   }
 
@@ -59,37 +370,133 @@ typedef struct _HttpData {
     response_status = status;
   }
 
+  // body is kept by the wrapper until it has been written
   void sendResponse(string str){
     if(!complete) return;
-    ostringstream ss;
-    int len = str.length();
+    body_owned = std::move(str);
+    sendResponse((char*)body_owned.data(), body_owned.length(), NULL, NULL);
+  }
+
+  // body is borrowed, _release is called with _hint once it has been written
+  void sendResponse(char* base, size_t len, body_release_cb _release, void* _hint){
+    if(!complete) {
+      if(_release != NULL) _release(base, _hint);
+      return;
+    }
+    body = {.base = base, .len = len};
+    release = _release;
+    release_hint = _hint;
+
+    // compressed responses are built on the event loop once compression is done
+    response_encoding = encoding_identity;
+    if (isCompressible() && len >= (size_t) compression_min_size) response_encoding = accept_encoding;
+    if (!needsCompression()) buildResponse();
+
+    async.data = this;
+    uv_async_send(&async);
+  }
+
+  // replace the body with its compressed version
+  void useCompressedBody(){
+    release_body();
+    body = {.base = (char*)compressed.data(), .len = compressed.length()};
+    setResponseHeader("Content-Encoding", encoding_names[response_encoding]);
+  }
 
-    ss << "HTTP/1.1 " << response_status << " OK" << CRLF;
+  // build header block and the buffers of the response
+  void buildResponse(){
+    size_t len = body.len;
+    bool isChunked = response_header->count("Transfer-Encoding") 
+      && (*response_header)["Transfer-Encoding"] == "chunked";
+
+    // tell the client when this is the last response on the connection
+    setResponseHeader("Connection", should_keep_alive() ? "keep-alive" : "close");
+    if (!isChunked && response_status != 304 && (file == NULL || !response_header->count("Content-Length"))) {
+      setResponseHeader("Content-Length", to_string(len));
+    }
+    if (enable_etag && response_status == 200 && len > 0 && file == NULL) {
+      // a compressed variant gets its own tag
+      char tag[48];
+      uint64_t hash = body_hashed ? body_hash : hash64(body.base, len);
+      const char* variant = response_encoding == encoding_identity ? "" : encoding_names[response_encoding];
+      snprintf(tag, sizeof(tag), "\"%016llx%s%s\"", (unsigned long long) hash, *variant ? "-" : "", variant);
+      etag = tag;
+      setResponseHeader("ETag", etag);
+    }
+    if (isCompressible()) setResponseHeader("Vary", "Accept-Encoding");
+
+    ostringstream ss;
+    ss << "HTTP/1.1 " << response_status << " " << status_text(response_status) << CRLF;
 
     for (auto &header : *response_header) {
       ss << header.first << ": " << header.second << CRLF;
     }
     ss << CRLF;
-     
-    bool isChunked = response_header->count("Transfer-Encoding") 
-      && (*response_header)["Transfer-Encoding"] == "chunked";
 
-    if (isChunked) {
-      ss << std::hex << len 
-         << std::dec << CRLF << str << CRLF;
+    nbufs = 0;
+    if (isChunked && len > 0) {
+      ss << std::hex << len << std::dec << CRLF;
     }
-    else {
-      ss << str;
+    header_block = ss.str();
+    bufs[nbufs++] = {.base = (char*)header_block.data(), .len = header_block.length()};
+
+    if (len > 0) {
+      bufs[nbufs++] = body;
     }
 
     if (isChunked) {
-      ss << "0" << CRLF << CRLF;
+      const string &tail = len > 0 ? last_chunk : chunk_terminator;
+      bufs[nbufs++] = {.base = (char*)tail.data(), .len = tail.length()};
     }
+  }
 
-    resBuf.base = CharCopy(ss.str().c_str()),
-    resBuf.len = strlen(resBuf.base);
-    async.data = this;
-    uv_async_send(&async);
+  // hash of a body shared by several responses, computed once instead of in every buildResponse
+  void setBodyHash(uint64_t hash){
+    body_hash = hash;
+    body_hashed = true;
+  }
+
+  // If-None-Match holds etag, compared weakly as the header requires
+  bool matchesEtag(const string &tag){
+    const char* value;
+    size_t value_len;
+    if(tag.empty() || !getRequestHeader("If-None-Match", &value, &value_len)) return false;
+    const char* end = value + value_len;
+    while(value < end){
+      while(value < end && (*value == ' ' || *value == ',')) value++;
+      const char* token_end = (const char*) memchr(value, ',', end - value);
+      if(token_end == NULL) token_end = end;
+      size_t len = token_end - value;
+      while(len > 0 && value[len - 1] == ' ') len--;
+      if(len == 1 && *value == '*') return true;
+      if(len > 2 && strncmp(value, "W/", 2) == 0){
+        value += 2;
+        len -= 2;
+      }
+      if(len == tag.length() && memcmp(value, tag.data(), len) == 0) return true;
+      value = token_end;
+    }
+    return false;
+  }
+
+  // answer 304 instead of the body the client already holds
+  void notModified(const string &tag){
+    release_body();
+    response_header->clear();
+    setResponseStatus(304);
+    setResponseHeader("ETag", tag);
+    if (enable_compression) setResponseHeader("Vary", "Accept-Encoding");
+    buildResponse();
+  }
+
+  // copy of the whole response as it is sent on the wire, without the Connection header
+  // which write_cached adds for the connection the copy is written to
+  string serialize(){
+    string out;
+    for (unsigned int i = 0; i < nbufs; i++) out.append(bufs[i].base, bufs[i].len);
+    size_t at = out.find(CRLF + "Connection: ");
+    if (at != string::npos) out.erase(at + 2, out.find(CRLF, at + 2) - at);
+    return out;
   }
 } HttpData;
 
@@ -99,24 +506,28 @@ namespace parser{
   // called after the url has been parsed.
   int on_url(http_parser* parser, const char* at, size_t len){
     HttpData* wrapper = static_cast<HttpData*>(parser->data);
-    if (at && wrapper) { wrapper->request_url = string(at, len); }
+    if (at && wrapper) { wrapper->request_url.append(at, len); } // url may be split across reads
     return 0;
   };
 
   // called when there are either fields or values in the request.
+  // a field may be split across several calls when the request spans several reads
   int on_header_field(http_parser* parser, const char* at, size_t length){
-    return 0;
+    HttpData* wrapper = static_cast<HttpData*>(parser->data);
+    return wrapper->add_header_bytes(at, length, false) ? 0 : -1;
   };
 
   // called when header value is given
   int on_header_value(http_parser* parser, const char* at, size_t length){
-    return 0;
+    HttpData* wrapper = static_cast<HttpData*>(parser->data);
+    return wrapper->add_header_bytes(at, length, true) ? 0 : -1;
   };
 
   // called once all fields and values have been parsed.
   int on_headers_complete(http_parser* parser){
     HttpData* wrapper = static_cast<HttpData*>(parser->data);
     wrapper->request_method = string(http_method_str((enum http_method) parser->method));
+    wrapper->keep_alive = http_should_keep_alive(parser);
     return 0;
   };
 
@@ -124,15 +535,17 @@ namespace parser{
   int on_body(http_parser* parser, const char* at, size_t len){
     HttpData* wrapper = static_cast<HttpData*>(parser->data);
     if (at && wrapper && (int) len > -1) {
-      wrapper->request_body << at;
+      wrapper->request_body.write(at, len);
     }
     return 0;
   };
 
   // called after all other events.
+  // pause the parser so pipelined requests are left for after this one is answered
   int on_message_complete(http_parser* parser){
     HttpData* wrapper = static_cast<HttpData*>(parser->data);
     wrapper->complete = true;
+    http_parser_pause(parser, 1);
     return 0;
   };
 
@@ -151,49 +564,428 @@ namespace parser{
 }; // namespace parser
 
 
+// Open file of a static route with the headers derived from its stat
+typedef struct static_file {
+  string path;
+  uv_file fd;
+  int64_t size;
+  string last_modified;
+  const char* content_type;
+  uint64_t checked_at;
+  int refs;
+  bool evicted;
+  list<static_file*>::iterator lru;
+} static_file;
+
+static const char* content_type_of(const string &path){
+  static const map<string, const char*> types = {
+    {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"},
+    {"js", "application/javascript"}, {"json", "application/json"}, {"map", "application/json"},
+    {"txt", "text/plain"}, {"xml", "application/xml"}, {"svg", "image/svg+xml"},
+    {"png", "image/png"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"gif", "image/gif"},
+    {"webp", "image/webp"}, {"ico", "image/vnd.microsoft.icon"},
+    {"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"}
+  };
+  size_t dot = path.rfind('.');
+  if(dot == string::npos) return "application/octet-stream";
+  auto it = types.find(path.substr(dot + 1));
+  return it == types.end() ? "application/octet-stream" : it->second;
+}
+
+// LRU cache of open files and their stat, owned by a single event loop so it is lockless
+// entries in use by a transfer are closed once the transfer is done
+class StaticFileCache {
+  private:
+    unordered_map<string, static_file*> files;
+    list<static_file*> lru;
+    unordered_set<static_file*> evicted; // removed while a transfer still uses them
+    size_t capacity;
+
+    void close_file(static_file* f){
+      if(f->refs > 0) {
+        f->evicted = true;
+        evicted.insert(f);
+        return;
+      }
+      if(f->evicted) evicted.erase(f);
+      ::close(f->fd);
+      delete f;
+    }
+
+    void remove(static_file* f){
+      files.erase(f->path);
+      lru.erase(f->lru);
+      close_file(f);
+    }
+
+  public:
+    StaticFileCache(size_t _capacity){
+      capacity = _capacity;
+    };
+
+    virtual ~StaticFileCache(){
+      for(auto f : lru) { f->refs = 0; close_file(f); }
+      for(auto f : vector<static_file*>(evicted.begin(), evicted.end())) { f->refs = 0; close_file(f); }
+    };
+
+    // fresh entry or NULL, entries older than static_stat_ttl are dropped so the file is stat again
+    static_file* acquire(const string &path, uint64_t now){
+      auto it = files.find(path);
+      if(it == files.end()) return NULL;
+      static_file* f = it->second;
+      if(now - f->checked_at > (uint64_t) static_stat_ttl){
+        remove(f);
+        return NULL;
+      }
+      lru.splice(lru.begin(), lru, f->lru);
+      f->refs++;
+      return f;
+    }
+
+    static_file* insert(const string &path, uv_file fd, const uv_stat_t* st, uint64_t now){
+      auto it = files.find(path);
+      if(it != files.end()) remove(it->second);
+      while(files.size() >= capacity && !lru.empty()) remove(lru.back());
+
+      static_file* f = new static_file;
+      f->path = path;
+      f->fd = fd;
+      f->size = st->st_size;
+      f->content_type = content_type_of(path);
+      f->checked_at = now;
+      f->refs = 1;
+      f->evicted = false;
+
+      char date[64];
+      struct tm tm;
+      time_t mtime = st->st_mtim.tv_sec;
+      gmtime_r(&mtime, &tm);
+      strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+      f->last_modified = date;
+
+      lru.push_front(f);
+      f->lru = lru.begin();
+      files.insert({path, f});
+      return f;
+    }
+
+    void release(static_file* f){
+      f->refs--;
+      if(f->evicted && f->refs == 0) close_file(f);
+    }
+};
+
+
+// Event loop with its own listening socket, several of them share the same port
+// Each loop keeps pools of connection wrappers, write requests and read buffers
+typedef struct HttpLoop {
+  uv_loop_t* loop;
+  uv_tcp_t socket;
+  uv_timer_t stats_timer;
+  Thread* thread;
+  int id;
+
+  ObjectPool<HttpData> connections;
+  ObjectPool<uv_write_t> writes;
+  BufferPool read_buffers;
+  StaticFileCache static_files;
+
+  HttpLoop(int _id) :
+    connections(connection_pool_size),
+    writes(write_pool_size),
+    read_buffers(read_buffer_size, read_buffer_pool_size),
+    static_files(static_fd_cache_size) {
+    id = _id;
+    loop = uv_loop_new();
+    loop->data = this;
+    thread = NULL;
+    if(pool_stats_interval > 0){
+      uv_timer_init(loop, &stats_timer);
+      stats_timer.data = this;
+      uv_timer_start(&stats_timer, on_pool_stats, pool_stats_interval, pool_stats_interval);
+    }
+  };
+
+  ~HttpLoop(){
+    delete thread;
+  };
+
+  void print_stats(){
+    printf("HttpLoop-%d pools => connections hit/miss: %ld/%ld, writes hit/miss: %ld/%ld, read buffers hit/miss: %ld/%ld\n",
+      id, connections.hits, connections.misses, writes.hits, writes.misses, read_buffers.hits, read_buffers.misses);
+  }
+
+  static void on_pool_stats(uv_timer_t* timer){
+    static_cast<HttpLoop*>(timer->data)->print_stats();
+  }
+} HttpLoop;
+
+static inline HttpLoop* get_http_loop(uv_loop_t* loop){
+  return static_cast<HttpLoop*>(loop->data);
+}
+
+// read buffers come from the loop pool and go back there at the end of http_read
+static void http_alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf){
+  BufferPool& pool = get_http_loop(handle->loop)->read_buffers;
+  buf->base = pool.acquire();
+  buf->len = pool.size();
+}
+
+
 // this is required to avoid segfault when closing handle and deleting wrapper struct
+// the wrapper owns several handles, it goes back to the loop pool once the last of them is closed
 static void free_handle(uv_handle_t* handle){
   HttpData* wrapper = reinterpret_cast<HttpData*>(handle->data);
   handle->data = NULL;
-  delete wrapper;
+  if(--wrapper->open_handles == 0) {
+    wrapper->recycle();
+    get_http_loop(handle->loop)->connections.release(wrapper);
+  }
+}
+
+// close every handle of the connection, the async handle is kept open
+// while a response is still being produced on another thread
+static void close_connection(HttpData* wrapper){
+  if(wrapper->closing) return;
+  wrapper->closing = true;
+  on_connection_closed(wrapper->server);
+  uv_timer_stop(&wrapper->idle_timer);
+  uv_close((uv_handle_t*) &wrapper->idle_timer, free_handle);
+  uv_close((uv_handle_t*) &wrapper->handle, free_handle);
+  if(!wrapper->in_flight) uv_close((uv_handle_t*) &wrapper->async, free_handle);
+}
+
+static void send_file_chunk(HttpData* wrapper);
+
+// close persistent connection that has been idle for too long,
+// while a file is sent the timer is used to retry a sendfile that would block
+static void on_idle_timeout(uv_timer_t* timer){
+  HttpData* wrapper = static_cast<HttpData*>(timer->data);
+  if(wrapper->file != NULL) send_file_chunk(wrapper);
+  else close_connection(wrapper);
+}
+
+
+// Open a tcp socket with SO_REUSEPORT so every loop can bind the same address,
+// the kernel then distributes incoming connections between the listeners
+static int bind_reuseport(uv_tcp_t* handle, const struct sockaddr* address){
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return uv_translate_sys_error(errno);
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+    int err = uv_translate_sys_error(errno);
+    close(fd);
+    return err;
+  }
+  int status = uv_tcp_open(handle, fd);
+  if (status != 0) return status;
+  return uv_tcp_bind(handle, address, 0);
 }
 
 
 // Non Blocking HTTP Server with deferred write capability
 // Has asynchronous callback performed by eventloop itself
 // Therefore response can be written safely from multiple threads
+// Connections are accepted by one or more event loops, each running on its own thread
+typedef struct static_route {
+  string prefix;
+  string directory;
+} static_route;
+
+static void on_cache_tick(uv_timer_t* timer);
+static void warm_up_next(HttpServer* server);
+
 class HttpServer{
   private:
-    uv_loop_t* UV_LOOP;
-    uv_tcp_t socket_;
+    vector<HttpLoop*> loops;
+    uv_timer_t cache_timer;
+    vector<static_route> static_routes;
     function<void(HttpData*)> callback;
 
   public:
+    // admission control, shared by every loop
+    AtomicInt connections;
+    AtomicInt renders;
+    AtomicLong shed_connections;
+    AtomicLong shed_renders;
+
     cache_map cache;
+    DiskCache* disk_cache;
     cacheable cache_url;
+    cacheable coalesce_url; // routes sharing in-flight renders besides the cacheable ones
     http_parser_settings* settings;
-    http_parser* parser;
 
-    HttpServer(function<void(HttpData*)> _callback){
+    // cache warm-up, urls are rendered in the background from the first loop,
+    // the server reports ready once warm_up_fraction of them are cached,
+    // failed renders are retried up to warm_up_attempts times
+    vector<string> warm_urls;
+    size_t warm_next;
+    size_t warm_cached;
+    size_t warm_finished; // cached or given up
+    vector<int> warm_attempts; // failed attempts per render
+    vector<size_t> warm_retry; // failed renders waiting for another attempt
+    int warm_in_flight;
+    uv_loop_t* warm_loop;
+    atomic_bool ready;
+
+    HttpServer(function<void(HttpData*)> _callback) :
+      connections(0), renders(0), shed_connections(0), shed_renders(0) {
       callback = _callback;
       settings = parser::get_settings();
-      http_parser *parser = (http_parser*)malloc(sizeof(http_parser));
+      disk_cache = NULL;
+      warm_next = 0;
+      warm_cached = 0;
+      warm_finished = 0;
+      warm_in_flight = 0;
+      warm_loop = NULL;
+      ready.store(false);
     };
     ~HttpServer(){
-      delete settings;
-      free(parser);
+      free(settings);
+      for(auto l : loops) delete l;
     };
 
-    uv_loop_t* loop(){
-      return UV_LOOP;
-    }
-
     // forward call to callback
     void send_to_lambda(HttpData* data){
+      data->shared = enable_cache && cache_url.is_cache(data->request_url);
+      data->coalesce = (coalesce_cacheable && cache_url.is_cache(data->request_url)) || coalesce_url.is_cache(data->request_url);
       callback(data);
     }
 
-    int listen (const char* ip, int port) {
+    // keep cached pages in dir across restarts, pages written by another bundle are dropped,
+    // must be called before listen
+    void persist_cache(const char* dir, uint64_t bundle_hash){
+      disk_cache = new DiskCache(dir, bundle_hash);
+      if(!disk_cache->isOpen()){
+        fprintf(stderr, "Disk cache %s can not be opened\n", dir);
+        delete disk_cache;
+        disk_cache = NULL;
+        return;
+      }
+      printf("Disk cache loaded %d pages\n", disk_cache->load(&cache, monotonic_millis()));
+      disk_cache->start();
+    }
+
+    // urls to render before the server is ready, one path per line or a sitemap,
+    // must be called before listen
+    bool warm_up(const char* path){
+      ifstream file(path);
+      if(!file.is_open()) return false;
+      string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+      vector<string> urls;
+      if(content.find("<loc>") != string::npos){ // sitemap
+        regex loc("<loc>\\s*([^<\\s]+)\\s*</loc>");
+        for(sregex_iterator it(content.begin(), content.end(), loc), end; it != end; ++it) urls.push_back((*it)[1]);
+      }
+      else {
+        istringstream lines(content);
+        string line;
+        while(lines >> line) if(line[0] != '#') urls.push_back(line);
+      }
+
+      for(string &url : urls){
+        size_t scheme = url.find("://"); // only the path of absolute urls is rendered
+        if(scheme != string::npos){
+          size_t path_start = url.find('/', scheme + 3);
+          url = path_start == string::npos ? "/" : url.substr(path_start);
+        }
+        if(!url.empty() && url[0] == '/') warm_urls.push_back(url);
+      }
+      printf("Cache warm-up : %zu urls from %s\n", warm_urls.size(), path);
+      return true;
+    }
+
+    // a warm-up render is done, failed or expired renders are queued again until they
+    // run out of attempts. Once every render is finished the server is ready even if
+    // fewer than warm_up_fraction got cached
+    void warm_up_done(size_t index, bool cached){
+      warm_in_flight--;
+      if(cached) warm_cached++;
+      else if(++warm_attempts[index] < warm_up_attempts){
+        warm_retry.push_back(index);
+        warm_up_next(this);
+        return;
+      }
+      else printf("Cache warm-up : giving up on %s\n", warm_urls[index / 2].c_str());
+      warm_finished++;
+      size_t total = warm_urls.size() * 2;
+      if(!ready.load() && (warm_cached >= total * warm_up_fraction || warm_finished == total)){
+        ready.store(true);
+        printf("Cache warm-up : %zu of %zu renders cached, server is ready\n", warm_cached, total);
+      }
+      if(warm_finished == total) printf("Cache warm-up : done, %zu renders failed\n", total - warm_cached);
+      warm_up_next(this);
+    }
+
+    // serve files of directory for urls starting with prefix, a prefix without a trailing
+    // slash serves the single file given as directory, must be called before listen
+    void serve_static(const char* prefix, const char* directory){
+      string dir = directory;
+      if(!dir.empty() && dir.back() == '/') dir.pop_back();
+      static_routes.push_back({prefix, dir});
+    }
+
+    // path has a ".." segment, names merely containing ".." are fine
+    static bool has_parent_segment(const string &path){
+      size_t start = 0;
+      while(start <= path.length()){
+        size_t end = path.find('/', start);
+        if(end == string::npos) end = path.length();
+        if(end - start == 2 && path.compare(start, 2, "..") == 0) return true;
+        start = end + 1;
+      }
+      return false;
+    }
+
+    // decode %XX escapes, fails on a malformed escape or a NUL byte
+    static bool percent_decode(const string &in, string &out){
+      out.clear();
+      out.reserve(in.length());
+      for(size_t i = 0; i < in.length(); i++){
+        if(in[i] != '%'){
+          out.push_back(in[i]);
+          continue;
+        }
+        if(i + 2 >= in.length() || !isxdigit((unsigned char) in[i + 1]) || !isxdigit((unsigned char) in[i + 2])) return false;
+        char c = (char) stoi(in.substr(i + 1, 2), nullptr, 16);
+        if(c == '\0') return false;
+        out.push_back(c);
+        i += 2;
+      }
+      return true;
+    }
+
+    // file path of a static url, empty when the url is not a static route.
+    // The path is decoded first so an escaped ".." is caught too
+    string static_path(const string &url){
+      string target = url.substr(0, url.find_first_of("?#"));
+      for(auto &route : static_routes){
+        if(route.prefix.back() != '/'){ // single file
+          if(target == route.prefix) return route.directory;
+          continue;
+        }
+        if(target.compare(0, route.prefix.length(), route.prefix) != 0) continue;
+        string path;
+        if(!percent_decode(target.substr(route.prefix.length()), path)) return empty_string;
+        if(has_parent_segment(path)) return empty_string; // no escape from the directory
+        return route.directory + "/" + path;
+      }
+      return empty_string;
+    }
+
+    // pool counters of every loop, values are read without synchronization
+    void print_pool_stats(){
+      for(auto l : loops) l->print_stats();
+    }
+
+    void print_admission_stats(){
+      printf("Admission => connections: %d, renders: %d, shed connections: %ld, shed renders: %ld\n",
+        connections.get(), renders.get(), shed_connections.get(), shed_renders.get());
+    }
+
+    // num_loops event loops are started, 0 uses the number of detected cores
+    int listen (const char* ip, int port, int num_loops = num_http_loops) {
       int status = 0;
 
       #ifdef _WIN32
@@ -213,166 +1005,730 @@ class HttpServer{
         setenv("UV_THREADPOOL_SIZE", cores_string, 1);
       #endif
 
-      struct sockaddr_in address;
-
-      //UV_LOOP = uv_default_loop();
-      UV_LOOP = uv_loop_new();
-      uv_tcp_init(UV_LOOP, &socket_);
+      if (num_loops <= 0) num_loops = cores;
+      printf("Number of http event loops :  %d\n", num_loops);
 
+      struct sockaddr_in address;
       status = uv_ip4_addr(ip, port, &address);
       ASSERT_STATUS(status, "Resolve Address");
 
-      status = uv_tcp_bind(&socket_, (const struct sockaddr*) &address, 0);
-      ASSERT_STATUS(status, "Bind");
+      for (int i = 0; i < num_loops; i++) {
+        HttpLoop* l = new HttpLoop(i);
+        uv_tcp_init(l->loop, &l->socket);
+        l->socket.data = this;
+
+        status = bind_reuseport(&l->socket, (const struct sockaddr*) &address);
+        ASSERT_STATUS(status, "Bind");
 
-      status = uv_listen((uv_stream_t*) &socket_, MAX_WRITES, http_on_connect);
-      socket_.data = this;
+        status = uv_listen((uv_stream_t*) &l->socket, MAX_WRITES, http_on_connect);
+        ASSERT_STATUS(status, "Listen");
 
-      ASSERT_STATUS(status, "Listen");
+        loops.insert(loops.end(), l);
+      }
+
+      // expire cached pages from the first loop
+      if (enable_cache) {
+        uv_timer_init(loops[0]->loop, &cache_timer);
+        cache_timer.data = this;
+        uv_timer_start(&cache_timer, on_cache_tick, cache_tick, cache_tick);
+      }
+
+      // warm the cache from the first loop, its thread is not started yet
+      warm_loop = loops[0]->loop;
+      warm_attempts.assign(warm_urls.size() * 2, 0);
+      if (warm_urls.empty()) ready.store(true);
+      else warm_up_next(this);
+
+      // every loop except the last one runs on its own thread
+      for (int i = 0; i < num_loops - 1; i++) {
+        HttpLoop* l = loops[i];
+        l->thread = new Thread([l](){ uv_run(l->loop, UV_RUN_DEFAULT); });
+        l->thread->setName(str_format("HttpLoop-%d", i));
+        l->thread->start_detached();
+      }
 
       // init loop
-      uv_run(UV_LOOP, UV_RUN_DEFAULT);
+      uv_run(loops.back()->loop, UV_RUN_DEFAULT);
       return 0;
     }
 };
 
+static void on_cache_tick(uv_timer_t* timer){
+  HttpServer* server = static_cast<HttpServer*>(timer->data);
+  server->cache.expire(uv_now(timer->loop));
+}
+
+// render without a client on loop, the response only fills the cache
+static HttpData* background_request(HttpServer* server, uv_loop_t* loop){
+  HttpData* wrapper = get_http_loop(loop)->connections.acquire();
+  wrapper->server = server;
+  wrapper->background = true;
+  wrapper->complete = true;
+  wrapper->keep_alive = true; // cached response is served on keep-alive connections
+  http_parser_init(&wrapper->request_parser, HTTP_REQUEST); // never fed, keeps the parser state defined
+  wrapper->request_parser.data = wrapper;
+  uv_async_init(loop, &wrapper->async, async_callback);
+  wrapper->async.data = wrapper;
+  wrapper->open_handles = 1;
+  wrapper->deadline = monotonic_millis() + timeout;
+  wrapper->in_flight = true;
+  return wrapper;
+}
+
+// keep warm_up_concurrency warm-up renders in flight, every url is rendered
+// for gzip and identity clients, both renders are coalesced into one.
+// Retries of failed renders go first
+static void warm_up_next(HttpServer* server){
+  static const int encodings[2] = {encoding_gzip, encoding_identity};
+  size_t total = server->warm_urls.size() * 2;
+  while(server->warm_in_flight < warm_up_concurrency && (!server->warm_retry.empty() || server->warm_next < total)){
+    size_t index;
+    if(!server->warm_retry.empty()){
+      index = server->warm_retry.back();
+      server->warm_retry.pop_back();
+    }
+    else index = server->warm_next++;
+    HttpData* wrapper = background_request(server, server->warm_loop);
+    wrapper->request_url = server->warm_urls[index / 2];
+    wrapper->request_method = "GET";
+    wrapper->accept_encoding = encodings[index % 2];
+    wrapper->warming = true;
+    wrapper->warm_index = index;
+    server->warm_in_flight++;
+    server->renders.increment();
+    server->send_to_lambda(wrapper);
+  }
+}
+
+static void on_connection_closed(void* server){
+  static_cast<HttpServer*>(server)->connections.decrement();
+}
+
+// pre-built answer for connections over max_connections, the connection is closed once written
+static const string& overload_response(){
+  static const string response = "HTTP/1.1 503 Service Unavailable" + CRLF
+    + "Retry-After: " + to_string(retry_after) + CRLF
+    + "Content-Length: 0" + CRLF
+    + "Connection: close" + CRLF + CRLF;
+  return response;
+}
+
+// write the cached response with a single write, bytes are shared with the cache
+// and the Connection header of this connection goes after the cached header fields
+static void write_cached(HttpData* wrapper){
+  static const string keep_alive_field = "Connection: keep-alive" + CRLF;
+  static const string close_field = "Connection: close" + CRLF;
+  const string &connection = wrapper->should_keep_alive() ? keep_alive_field : close_field;
+  const uv_buf_t &page = wrapper->cached->buf;
+  size_t fields_len = wrapper->cached->fields_len;
+  wrapper->bufs[0] = {.base = page.base, .len = fields_len};
+  wrapper->bufs[1] = {.base = (char*) connection.data(), .len = connection.length()};
+  wrapper->bufs[2] = {.base = page.base + fields_len, .len = page.len - fields_len};
+  wrapper->nbufs = 3;
+  uv_write_t *_response = get_http_loop(wrapper->handle.loop)->writes.acquire();
+  uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_write_end);
+}
+
+// cache and write a response that is fully built
+static void write_response(HttpData* wrapper){
+  HttpServer* server = static_cast<HttpServer*>(wrapper->server);
+  uv_loop_t* loop = wrapper->async.loop; // tcp handle is not open for background renders
+  cache_rule rule;
+  bool cache_page = enable_cache && server->cache_url.match(wrapper->request_url, &rule) && rule.cache;
+  wire_buffer page;
+
+  // add to cache, keyed by the encoding the client asked for, failed renders are not cached
+  if(cache_page && wrapper->response_status == 200) {
+    page = server->cache.add(wrapper->request_url, wrapper->accept_encoding, wrapper->serialize(), rule.ttl, uv_now(loop));
+    if(server->disk_cache != NULL) server->disk_cache->append(wrapper->request_url, wrapper->accept_encoding, page, millis() + rule.ttl);
+  }
+
+  // background render only refreshes the cache
+  if(wrapper->background){
+    if(wrapper->warming) server->warm_up_done(wrapper->warm_index, wrapper->response_status == 200);
+    else if(wrapper->response_status != 200) server->cache.revalidateFailed(wrapper->request_url);
+    wrapper->release_body();
+    uv_close((uv_handle_t*) &wrapper->async, free_handle);
+    return;
+  }
+
+  // client already holds the rendered page
+  if(wrapper->response_status == 200 && wrapper->matchesEtag(wrapper->etag)){
+    wrapper->notModified(wrapper->etag);
+    uv_write_t *_response = get_http_loop(loop)->writes.acquire();
+    uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_write_end);
+    return;
+  }
+
+  // write the cached bytes, the body is no longer needed
+  if(page){
+    wrapper->release_body();
+    wrapper->cached = page;
+    write_cached(wrapper);
+    return;
+  }
+
+  // render failed, serve the stale copy while it is within stale-if-error
+  if(cache_page && wrapper->response_status >= 500
+      && server->cache.getStale(wrapper->request_url, wrapper->accept_encoding, &page, uv_now(loop))){
+    wrapper->release_body();
+    wrapper->cached = page;
+    write_cached(wrapper);
+    return;
+  }
+
+  uv_write_t *_response = get_http_loop(loop)->writes.acquire();
+  uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_write_end);
+}
+
+// runs on the thread pool
+static void compress_response(uv_work_t* req){
+  HttpData* wrapper = static_cast<HttpData*>(req->data);
+  if(!compress_body(wrapper->body.base, wrapper->body.len, wrapper->response_encoding, compression_level, &wrapper->compressed)){
+    wrapper->response_encoding = encoding_identity; // send it uncompressed
+  }
+}
+
+// back on the event loop once compression is done
+static void after_compress_response(uv_work_t* req, int status){
+  HttpData* wrapper = static_cast<HttpData*>(req->data);
+  wrapper->in_flight = false;
+
+  // connection was closed while the response was compressed
+  if(wrapper->closing){
+    uv_close((uv_handle_t*) &wrapper->async, free_handle);
+    return;
+  }
+
+  if(status == 0 && wrapper->needsCompression()) wrapper->useCompressedBody();
+  wrapper->buildResponse();
+  write_response(wrapper);
+}
+
 // async http write
 static void async_callback(uv_async_t *handle){
   HttpData* wrapper = static_cast<HttpData*>(handle->data);
-  free_async_handle(handle);
+  static_cast<HttpServer*>(wrapper->server)->renders.decrement(); // render is done
+
+  // compress on the thread pool, response is written once it is done
+  if(wrapper->complete && !wrapper->closing && wrapper->needsCompression()){
+    wrapper->compress_work.data = wrapper;
+    uv_queue_work(handle->loop, &wrapper->compress_work, compress_response, after_compress_response);
+    return;
+  }
+
+  wrapper->in_flight = false;
+
+  // connection was closed while the response was produced
+  if(wrapper->closing){
+    uv_close((uv_handle_t*) handle, free_handle);
+    return;
+  }
 
   if(wrapper->complete){ // on successful read, write processed data
-    HttpServer* server = static_cast<HttpServer*>(wrapper->server);
-    // add to cache
-    if(enable_cache && server->cache_url.is_cache(wrapper->request_url) ) {
-      server->cache.add(wrapper->request_url, wrapper->resBuf.base, cache_timeout);
-    }
-    uv_write_t *_response = (uv_write_t *) malloc(sizeof(uv_write_t));
-    uv_write(_response, (uv_stream_t *) &wrapper->handle, &wrapper->resBuf, 1, on_write_end);
+    write_response(wrapper);
   }
   else { // on read error close the handle
-    uv_close((uv_handle_t*) &wrapper->handle, free_handle); // async, so need callback
+    close_connection(wrapper);
     println("Close handle on error");
   }
 };
 
-// after write cleanup
+static void parse_request(HttpData* wrapper, const char* data, size_t len);
+
+// after write, either serve the next pipelined request, wait for the next request on the connection or close it
+static void finish_response(HttpData* wrapper, int status);
 static void on_write_end(uv_write_t* response, int status) {
-  uv_handle_t* handle = (uv_handle_t*)response->handle;
-  response->handle = NULL;
-  uv_unref(handle);
-  uv_close(handle, free_handle);  // async, so need callback
-  free(response);
+  uv_stream_t* stream = response->handle;
+  HttpData* wrapper = static_cast<HttpData*>(stream->data);
+  get_http_loop(stream->loop)->writes.release(response);
+  finish_response(wrapper, status);
 };
 
-// called on every read
-static void http_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t* buf) {
-  HttpData* wrapper = static_cast<HttpData*>(tcp->data);
+static void finish_response(HttpData* wrapper, int status) {
+  // body has been written, give it back to the producer
+  wrapper->release_body();
+
+  if(status < 0 || !wrapper->should_keep_alive()){
+    close_connection(wrapper);
+    return;
+  }
+
+  wrapper->reset();
+  // parser is paused after every complete request, a new connection inits it instead
+  if(HTTP_PARSER_ERRNO(&wrapper->request_parser) == HPE_PAUSED) http_parser_pause(&wrapper->request_parser, 0);
+
+  if(!wrapper->pending_input.empty()){
+    string input;
+    input.swap(wrapper->pending_input);
+    parse_request(wrapper, input.data(), input.length());
+    if(wrapper->complete || wrapper->closing) return; // next request has been dispatched
+  }
+
+  uv_timer_start(&wrapper->idle_timer, on_idle_timeout, keep_alive_timeout, 0);
+  uv_read_start((uv_stream_t*) &wrapper->handle, http_alloc_buffer, http_read);
+};
+
+// release the file of a static transfer
+static void end_file_transfer(HttpData* wrapper){
+  if(wrapper->file == NULL) return;
+  get_http_loop(wrapper->handle.loop)->static_files.release(wrapper->file);
+  wrapper->file = NULL;
+}
+
+static void on_file_chunk_sent(uv_fs_t* req){
+  HttpData* wrapper = static_cast<HttpData*>(req->data);
+  ssize_t result = req->result;
+  uv_fs_req_cleanup(req);
+
+  // socket buffer is full, try again later with a growing delay, a client that
+  // reads nothing for keep_alive_timeout is dropped. The tcp handle already polls
+  // the socket so its writability can not be watched with another poll
+  if(result == UV_EAGAIN && wrapper->file_stalled < keep_alive_timeout){
+    wrapper->file_backoff = wrapper->file_backoff == 0 ? 1 : min(wrapper->file_backoff * 2, file_send_max_backoff);
+    wrapper->file_stalled += wrapper->file_backoff;
+    uv_timer_start(&wrapper->idle_timer, on_idle_timeout, wrapper->file_backoff, 0);
+    return;
+  }
+  if(result <= 0){ // 0 is the end of a file truncated since its stat
+    fprintf(stderr, "Sendfile error %s\n", result == 0 ? "file truncated" : uv_err_name(result));
+    end_file_transfer(wrapper);
+    finish_response(wrapper, result == 0 ? UV_EOF : result);
+    return;
+  }
+
+  wrapper->file_offset += result;
+  wrapper->file_remaining -= result;
+  wrapper->file_backoff = 0;
+  wrapper->file_stalled = 0;
+  send_file_chunk(wrapper);
+}
+
+// send the rest of the file straight from the page cache to the socket
+static void send_file_chunk(HttpData* wrapper){
+  if(wrapper->file_remaining == 0){
+    end_file_transfer(wrapper);
+    finish_response(wrapper, 0);
+    return;
+  }
+  uv_os_fd_t socket_fd;
+  uv_fileno((uv_handle_t*) &wrapper->handle, &socket_fd);
+  wrapper->fs_req.data = wrapper;
+  uv_fs_sendfile(wrapper->handle.loop, &wrapper->fs_req, socket_fd, wrapper->file->fd,
+    wrapper->file_offset, wrapper->file_remaining, on_file_chunk_sent);
+}
+
+static void on_file_header_written(uv_write_t* response, int status){
+  uv_stream_t* stream = response->handle;
+  HttpData* wrapper = static_cast<HttpData*>(stream->data);
+  get_http_loop(stream->loop)->writes.release(response);
+  if(status < 0){
+    end_file_transfer(wrapper);
+    finish_response(wrapper, status);
+    return;
+  }
+  send_file_chunk(wrapper);
+}
+
+// write the header block, then the file body with sendfile
+static void start_file_transfer(HttpData* wrapper, static_file* file){
+  wrapper->file = file;
+  wrapper->file_offset = 0;
+  wrapper->file_remaining = wrapper->request_method == "HEAD" ? 0 : file->size;
+  wrapper->file_backoff = 0;
+  wrapper->file_stalled = 0;
+  wrapper->setResponseStatus(200);
+  wrapper->setResponseHeader("Content-Type", file->content_type);
+  wrapper->setResponseHeader("Content-Length", to_string(file->size));
+  wrapper->setResponseHeader("Last-Modified", file->last_modified);
+  wrapper->buildResponse();
+  uv_write_t *_response = get_http_loop(wrapper->handle.loop)->writes.acquire();
+  uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_file_header_written);
+}
+
+// answer directly from the event loop with a short body
+static void send_status(HttpData* wrapper, int status){
+  wrapper->setResponseStatus(status);
+  wrapper->setResponseHeader("Content-Type", "text/plain");
+  wrapper->body_owned = status_text(status);
+  wrapper->body = {.base = (char*)wrapper->body_owned.data(), .len = wrapper->body_owned.length()};
+  wrapper->buildResponse();
+  uv_write_t *_response = get_http_loop(wrapper->handle.loop)->writes.acquire();
+  uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_write_end);
+}
+
+static void on_static_stat(uv_fs_t* req){
+  HttpData* wrapper = static_cast<HttpData*>(req->data);
+  uv_file fd = wrapper->file_fd;
+  bool is_file = req->result == 0 && S_ISREG(req->statbuf.st_mode);
+  uv_stat_t st = req->statbuf;
+  uv_fs_req_cleanup(req);
+
+  if(!is_file){
+    uv_fs_t close_req;
+    uv_fs_close(wrapper->handle.loop, &close_req, fd, NULL);
+    uv_fs_req_cleanup(&close_req);
+    send_status(wrapper, 404);
+    return;
+  }
+  HttpLoop* l = get_http_loop(wrapper->handle.loop);
+  start_file_transfer(wrapper, l->static_files.insert(wrapper->file_path, fd, &st, uv_now(wrapper->handle.loop)));
+}
+
+static void on_static_open(uv_fs_t* req){
+  HttpData* wrapper = static_cast<HttpData*>(req->data);
+  ssize_t fd = req->result;
+  uv_fs_req_cleanup(req);
+
+  if(fd < 0){
+    send_status(wrapper, fd == UV_EACCES ? 403 : 404);
+    return;
+  }
+  wrapper->file_fd = fd; // kept until fstat is done
+  wrapper->fs_req.data = wrapper;
+  uv_fs_fstat(wrapper->handle.loop, &wrapper->fs_req, fd, on_static_stat);
+}
+
+// serve a file from the loop fd cache, open and stat it on a miss
+static void send_static_file(HttpData* wrapper, const string &path){
+  if(wrapper->request_method != "GET" && wrapper->request_method != "HEAD"){
+    send_status(wrapper, 405);
+    return;
+  }
+  HttpLoop* l = get_http_loop(wrapper->handle.loop);
+  static_file* file = l->static_files.acquire(path, uv_now(wrapper->handle.loop));
+  if(file != NULL){
+    start_file_transfer(wrapper, file);
+    return;
+  }
+  wrapper->file_path = path;
+  wrapper->fs_req.data = wrapper;
+  uv_fs_open(wrapper->handle.loop, &wrapper->fs_req, path.c_str(), O_RDONLY, 0, on_static_open);
+}
+
+// render a stale page again without a client, the result only refreshes the cache
+static void revalidate_page(HttpData* from){
+  HttpServer* server = static_cast<HttpServer*>(from->server);
+
+  // revalidation is dropped under load, the next stale hit tries again
+  if(server->renders.increment_get() > max_in_flight_renders){
+    server->renders.decrement();
+    server->cache.revalidateFailed(from->request_url);
+    return;
+  }
+
+  HttpData* wrapper = background_request(server, from->handle.loop);
+  wrapper->copyRequest(from);
+  server->send_to_lambda(wrapper);
+}
+
+// dispatch fully parsed request, either from cache or to the server lambda
+static void dispatch_request(HttpData* wrapper){
   HttpServer* server = static_cast<HttpServer*>(wrapper->server);
 
-  // ON NO ERROR
-  if (nread >= 0) {
-    http_parser parser;
-    http_parser_init(&parser, HTTP_REQUEST);
-    parser.data = wrapper;
-    ssize_t parsed = http_parser_execute(&parser, server->settings, buf->base, nread);
-    parser.data = NULL;
-
-    // close handle on parse error
-    if (parsed < nread) {
-      println("Parse Error : closing handle");
-      uv_close((uv_handle_t*) &wrapper->handle, free_handle);
-    }
-    
-    // cache hit
-    if(enable_cache){
-      string* from_cache = server->cache.get(wrapper->request_url);
-      if(from_cache){
-        wrapper->resBuf.base = CharCopy(from_cache->c_str()); 
-        wrapper->resBuf.len = from_cache->length();
-        wrapper->server = NULL;
-        uv_write_t *_response = (uv_write_t *) malloc(sizeof(uv_write_t));
-        uv_write(_response, (uv_stream_t *) &wrapper->handle, &wrapper->resBuf, 1, on_write_end);
+  // request is being processed, stop reading and idle timer until the response is written
+  uv_timer_stop(&wrapper->idle_timer);
+  uv_read_stop((uv_stream_t*) &wrapper->handle);
+  wrapper->request_count++;
+  wrapper->accept_encoding = wrapper->negotiateEncoding();
+
+  // readiness probe, not ready until the cache warm-up is far enough
+  if(wrapper->request_url == readiness_path){
+    send_status(wrapper, server->ready.load() ? 200 : 503);
+    return;
+  }
+
+  // static files are sent from this loop
+  string path = server->static_path(wrapper->request_url);
+  if(!path.empty()){
+    send_static_file(wrapper, path);
+    return;
+  }
+  
+  // cache hit, a stale page is served as is and rendered again in the background
+  if(enable_cache){
+    bool revalidate = false;
+    if(server->cache.get(wrapper->request_url, wrapper->accept_encoding, &wrapper->cached, uv_now(wrapper->handle.loop), &revalidate) != cache_miss){
+      if(revalidate) revalidate_page(wrapper);
+
+      // client already holds the cached page, the renderer is not involved
+      if(wrapper->matchesEtag(wrapper->cached->etag)){
+        string etag = wrapper->cached->etag;
+        wrapper->cached.reset();
+        wrapper->notModified(etag);
+        uv_write_t *_response = get_http_loop(wrapper->handle.loop)->writes.acquire();
+        uv_write(_response, (uv_stream_t *) &wrapper->handle, wrapper->bufs, wrapper->nbufs, on_write_end);
+        return;
       }
+      write_cached(wrapper);
+      return;
     }
+  }
 
-    // cache miss
-    else {
-      uv_async_init(server->loop(), &wrapper->async, async_callback); // create async handler
-      server->send_to_lambda(wrapper); // send request wrapper to server lambda
-    }
+  // shed load when too many requests are waiting for a renderer
+  if(server->renders.increment_get() > max_in_flight_renders){
+    server->renders.decrement();
+    server->shed_renders.increment();
+    wrapper->setResponseHeader("Retry-After", to_string(retry_after));
+    send_status(wrapper, 503);
+    return;
+  }
+
+  // cache miss
+  wrapper->deadline = monotonic_millis() + timeout;
+  wrapper->in_flight = true;
+  server->send_to_lambda(wrapper); // send request wrapper to server lambda
+}
+
+// feed data into the connection parser, the request is dispatched once it is complete
+static void parse_request(HttpData* wrapper, const char* data, size_t len){
+  HttpServer* server = static_cast<HttpServer*>(wrapper->server);
+  size_t parsed = http_parser_execute(&wrapper->request_parser, server->settings, data, len);
+  enum http_errno err = HTTP_PARSER_ERRNO(&wrapper->request_parser);
+
+  // close handle on parse error
+  if (err != HPE_OK && err != HPE_PAUSED) {
+    fprintf(stderr, "Parse Error %s : closing handle\n", http_errno_name(err));
+    close_connection(wrapper);
+    return;
+  }
+
+  // wait for the rest of the request
+  if (!wrapper->complete) return;
+
+  // keep the bytes of pipelined requests for later
+  if (parsed < len) wrapper->pending_input.append(data + parsed, len - parsed);
+  dispatch_request(wrapper);
+}
+
+// called on every read
+static void http_read(uv_stream_t* tcp, ssize_t nread, const uv_buf_t* buf) {
+  HttpData* wrapper = static_cast<HttpData*>(tcp->data);
+
+  // ON NO ERROR
+  if (nread > 0) {
+    parse_request(wrapper, buf->base, nread);
   } 
   
   // ON ERROR
-  else {
-    // @TODO - debug error : if (nread != UV_EOF) {}
+  else if (nread < 0) {
+    if (nread != UV_EOF) fprintf(stderr, "Read error %s\n", uv_err_name(nread));
     // close handle
-    println("Read Error!!");
-    uv_close((uv_handle_t*) &wrapper->handle, free_handle);
+    close_connection(wrapper);
   }
 
-  // free request buffer data
-  free(buf->base);
+  // return request buffer to the pool
+  get_http_loop(tcp->loop)->read_buffers.release(buf->base);
 }
 
 // called once a connection is made.
 static void http_on_connect(uv_stream_t* handle, int status){
   HttpServer* server = static_cast<HttpServer*>(handle->data);
-  HttpData *wrapper = new HttpData();
+  HttpData *wrapper = get_http_loop(handle->loop)->connections.acquire();
 
   // pass pointer to server on wrapper handle
   wrapper->server = server;
 
-  // init tcp handle
-  uv_tcp_init(server->loop(), &wrapper->handle);
+  // init tcp handle on the loop that accepted the connection
+  uv_loop_t* loop = handle->loop;
+  uv_tcp_init(loop, &wrapper->handle);
 
   // client reference for handle data on requests
   wrapper->handle.data = wrapper;
 
+  // one parser for the whole connection
+  http_parser_init(&wrapper->request_parser, HTTP_REQUEST);
+  wrapper->request_parser.data = wrapper;
+
+  // async handler and idle timer live as long as the connection
+  uv_async_init(loop, &wrapper->async, async_callback);
+  wrapper->async.data = wrapper;
+  uv_timer_init(loop, &wrapper->idle_timer);
+  wrapper->idle_timer.data = wrapper;
+  wrapper->open_handles = 3;
+
   // accept connection passing in refernce to the client handle
-  uv_accept(handle, (uv_stream_t*) &wrapper->handle);
+  server->connections.increment();
+  if (uv_accept(handle, (uv_stream_t*) &wrapper->handle) != 0) {
+    close_connection(wrapper);
+    return;
+  }
+
+  // over the limit, answer with the pre-built 503 and close
+  if (server->connections.get() > max_connections) {
+    server->shed_connections.increment();
+    const string &response = overload_response();
+    uv_buf_t buf = {.base = (char*)response.data(), .len = response.length()};
+    uv_write_t *_response = get_http_loop(loop)->writes.acquire();
+    uv_write(_response, (uv_stream_t *) &wrapper->handle, &buf, 1, on_write_end);
+    return;
+  }
 
   // allocate memory and attempt to read.
-  uv_read_start((uv_stream_t*) &wrapper->handle, alloc_buffer, http_read);
+  uv_timer_start(&wrapper->idle_timer, on_idle_timeout, keep_alive_timeout, 0);
+  uv_read_start((uv_stream_t*) &wrapper->handle, http_alloc_buffer, http_read);
 }
 
 
 // for inter process communication
 namespace ipc {
   static void free_ipc_handle(uv_handle_t* handle);
-  static void re_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf);
   static void on_write(uv_write_t* req, int status);
-  static void async_write(uv_async_t* handle);
   static void on_read(uv_stream_t* client, ssize_t nread,const uv_buf_t* buf);
   static void on_new_client(uv_stream_t* server, int status);
+  static void on_shm_request(uv_poll_t* handle, int status, int events);
+
+  // Frames of the renderer protocol, in both directions a header then length bytes of payload.
+  // A response carries the id of its request so several requests can be outstanding on a pipe
+  typedef struct frame_header {
+    uint32_t id;
+    uint32_t length;
+  } frame_header;
+
+  typedef function<void(uint32_t id, const char* payload, size_t length)> frame_callback;
+
+  // Cut a byte stream into frames, bytes of an incomplete frame are kept for the next read
+  typedef struct frame_reader {
+    string pending;
+
+    // false when the stream is corrupt
+    bool feed(const char* data, size_t len, const frame_callback &on_frame){
+      pending.append(data, len);
+      size_t pos = 0;
+      while(pending.length() - pos >= sizeof(frame_header)){
+        frame_header header;
+        memcpy(&header, pending.data() + pos, sizeof(header));
+        if(header.length > max_frame_size) return false;
+        if(pending.length() - pos - sizeof(header) < header.length) break;
+        on_frame(header.id, pending.data() + pos + sizeof(header), header.length);
+        pos += sizeof(header) + header.length;
+      }
+      pending.erase(0, pos);
+      return true;
+    }
+  } frame_reader;
+
+  // give the payload of an assembled frame back, pool is NULL for frames larger than a pool block
+  static void release_frame(char* payload, void* pool){
+    if(pool != NULL) static_cast<SharedBufferPool*>(pool)->release(payload);
+    else free(payload);
+  }
+
+  typedef function<void(uint32_t id, char* payload, size_t length, void* pool)> owned_frame_callback;
+
+  // Read frames straight into their own buffer : the pipe reads the header, then the payload
+  // into a pooled buffer sized from the header, plus room for the next header so a read rarely
+  // stops short. A completed payload is handed over without copy and freed with release_frame
+  typedef struct frame_assembler {
+    frame_header header;
+    size_t header_got;
+    char* payload;
+    size_t payload_got;
+    size_t payload_size;
+    SharedBufferPool* pool;
+    bool pooled;
+
+    frame_assembler(){
+      header_got = 0;
+      payload = NULL;
+      payload_got = 0;
+      payload_size = 0;
+      pool = NULL;
+      pooled = false;
+    };
+
+    ~frame_assembler(){
+      reset();
+    };
+
+    // drop a partly read frame, before reading from a new pipe
+    void reset(){
+      if(payload != NULL) release_frame(payload, pooled ? pool : NULL);
+      payload = NULL;
+      header_got = 0;
+      payload_got = 0;
+    }
 
+    // space the next read goes to, used from the alloc callback of the pipe
+    void alloc(uv_buf_t* buf){
+      if(payload == NULL) *buf = {.base = (char*) &header + header_got, .len = sizeof(frame_header) - header_got};
+      else *buf = {.base = payload + payload_got, .len = payload_size - payload_got};
+    }
 
+    // account nread bytes read into the space given by alloc, false when the stream is corrupt
+    bool consume(size_t nread, const owned_frame_callback &on_frame){
+      if(payload != NULL) payload_got += nread;
+      else header_got += nread;
+
+      while(true){
+        if(payload == NULL){
+          if(header_got < sizeof(frame_header)) return true;
+          if(header.length > max_frame_size) return false;
+          payload_size = header.length + sizeof(frame_header);
+          pooled = pool != NULL && payload_size <= pool->size();
+          payload = pooled ? pool->acquire() : (char*) malloc(payload_size);
+          payload_got = 0;
+          header_got = 0;
+        }
+        if(payload_got < header.length) return true;
+
+        // bytes past the payload are the start of the next header
+        frame_header done = header;
+        char* done_payload = payload;
+        header_got = payload_got - done.length;
+        memcpy(&header, done_payload + done.length, header_got);
+        payload = NULL;
+        on_frame(done.id, done_payload, done.length, pooled ? pool : NULL);
+      }
+    }
+  } frame_assembler;
+
+  // frame being written, freed once written
+  typedef struct frame_write {
+    uv_write_t req;
+    frame_header header;
+    string payload;
+    uv_buf_t bufs[2];
+  } frame_write;
+
+  // Connection of the balancer to a renderer process, requests are rendered in order
   typedef struct ipc_call{
     uv_buf_t req;
-    uv_buf_t res;
-    uv_async_t async_write;
+    uint32_t req_id;
     uv_pipe_t handle;
+    frame_reader reader;
     void* callback;
     void* server;
-    bool writeable;
+    ShmChannel* channel; // answers go to its ring when they fit, NULL for the pipe only
 
     ipc_call(){
       req = {.base = NULL, .len = 0};
-      res = {.base = NULL, .len = 0};
-      writeable = false;
+      req_id = 0;
+      channel = NULL;
     }
 
     ~ipc_call(){
       free(req.base);
-      free(res.base);
     }
 
+    // answer the request being handled, called from the ipc loop
     void send(string str){
-      res.base = CharCopy(str.c_str());
-      res.len = str.length();
-      async_write.data = this;
-      writeable = true;
-      uv_async_send(&async_write);
+      frame_write* w = new frame_write;
+      w->header = {req_id, (uint32_t) str.length()};
+      w->payload = std::move(str);
+      w->bufs[0] = {.base = (char*) &w->header, .len = sizeof(frame_header)};
+      w->bufs[1] = {.base = (char*) w->payload.data(), .len = w->payload.length()};
+      w->req.data = this;
+      uv_write(&w->req, (uv_stream_t *) &handle, w->bufs, 2, on_write);
+    }
+
+    // answer with len bytes of data, copied once into the answer ring or sent over the pipe
+    void send(const char* data, size_t len){
+      if(channel != NULL && channel->answers->write(req_id, data, len)){
+        ShmChannel::notify(channel->answer_fd);
+        return;
+      }
+      send(string(data, len));
     }
 
     void free_req(){
@@ -380,68 +1736,22 @@ namespace ipc {
       req.base = NULL;
     }
 
-    void free_res(){
-      free(res.base);
-      res.base = NULL;
-    }
-
   } ipc_call;
 
 
   typedef function<void(ipc_call*)> ipc_callback;
-  void sync_write(ipc_call* ipc);
 
 
-  static void free_ipc_handle(uv_handle_t* handle){
-    ipc_call* ipc = static_cast<ipc_call*>(handle->data);
-    handle->data = NULL;
-    delete ipc;
-  }
-
-  static void re_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
-    ipc_call* ipc = static_cast<ipc_call*>(client->data);
-    if (nread > 0) {
-      ipc->free_req();
-      ipc->req.base = CharCopy(buf->base, nread);
-      ipc->req.len = nread;
-      ipc_callback* _callback = static_cast<ipc_callback*>(ipc->callback);
-      (*_callback)(ipc);
-    } else {
-      if (nread != UV_EOF)
-        fprintf(stderr, "IPC Handle re-Read error %s\n", uv_err_name(nread));
-      uv_close((uv_handle_t*)client, free_ipc_handle);
-    }
-    free(buf->base);
-  };
+  static void free_ipc_handle(uv_handle_t* handle);
 
   static void on_write(uv_write_t* req, int status) {
-    ipc_call* ipc = reinterpret_cast<ipc_call*>(req->data);
-    //printf("on write => status: %d, uv_status: %s\n",status, status == 0 ? "OK" : uv_err_name(status));
-    req->data = NULL;
-    if (status < 0) {
+    frame_write* w = reinterpret_cast<frame_write*>(req);
+    ipc_call* ipc = static_cast<ipc_call*>(req->data);
+    if (status < 0 && !uv_is_closing((uv_handle_t*) &ipc->handle)) {
       fprintf(stderr, "IPC Write error %s\n", uv_err_name(status));
       uv_close((uv_handle_t*) &ipc->handle, free_ipc_handle); // async, so need callback
     }
-    else {
-      ipc->writeable = false;
-      ipc->free_res();
-      uv_read_start((uv_stream_t*)&ipc->handle, alloc_buffer, re_read);
-    }
-    free(req);
-  }
-
-  static void async_write(uv_async_t* handle){
-    ipc_call* ipc = static_cast<ipc_call*>(handle->data);
-    if(ipc->writeable){ // on successful read, write processed data
-      uv_write_t *_write = (uv_write_t *) malloc(sizeof(uv_write_t));
-      _write->data = ipc;
-      uv_write(_write, (uv_stream_t *) &ipc->handle, &ipc->res, 1, on_write);
-    }
-    else { // on read error close the handle
-      free_async_handle(handle);
-      uv_close((uv_handle_t*) &ipc->handle, free_ipc_handle); // async, so need callback
-      println("IPC close handle on error");
-    }
+    delete w;
   }
 
   
@@ -449,9 +1759,14 @@ namespace ipc {
     private:
       ipc_callback callback;
       uv_loop_t* loop;
+      ShmChannel* channel;
+      uv_poll_t request_poll;
+      ipc_call* client; // connection of the balancer, answers too large for the ring go there
     public:
       IpcServer(ipc_callback _callback){
         callback = _callback;
+        channel = NULL;
+        client = NULL;
       }
       ~IpcServer(){}
 
@@ -463,40 +1778,99 @@ namespace ipc {
         return &callback;
       }
       
-      int listen(const char* socket_path){
+      ShmChannel* get_channel(){
+        return channel;
+      }
+
+      ipc_call* get_client(){
+        return client;
+      }
+
+      void set_client(ipc_call* ipc){
+        client = ipc;
+        if(ipc != NULL) ipc->channel = channel;
+      }
+
+      // requests also come through the request ring of _channel when it is open
+      int listen(const char* socket_path, ShmChannel* _channel = NULL){
         loop = uv_loop_new();
         uv_pipe_t server;
         uv_pipe_init(loop, &server, 0);
         uv_status("IPC Server Bind", uv_pipe_bind(&server, socket_path));
         server.data = this;
         uv_status("IPC Server Listen", uv_listen((uv_stream_t*)&server, MAX_WRITES, on_new_client));
+        if(_channel != NULL && _channel->isOpen()){
+          channel = _channel;
+          uv_poll_init(loop, &request_poll, channel->request_fd);
+          request_poll.data = this;
+          uv_poll_start(&request_poll, UV_READABLE, on_shm_request);
+        }
         return uv_run(loop, UV_RUN_DEFAULT);
       }
+
+      // handle every request in the ring, they wait there until the balancer is accepted
+      void serve_ring(){
+        if(channel == NULL || client == NULL) return;
+        shm_record* record;
+        while((record = channel->requests->next()) != NULL){
+          client->free_req();
+          client->req.base = CharCopy((char*) record + sizeof(shm_record), record->length);
+          client->req.len = record->length;
+          client->req_id = record->id;
+          channel->requests->release(record);
+          callback(client);
+        }
+      }
   };
 
+  static void free_ipc_handle(uv_handle_t* handle){
+    ipc_call* ipc = static_cast<ipc_call*>(handle->data);
+    IpcServer* s = static_cast<IpcServer*>(ipc->server);
+    if(s != NULL && s->get_client() == ipc) s->set_client(NULL);
+    handle->data = NULL;
+    delete ipc;
+  }
+
+  static void on_shm_request(uv_poll_t* handle, int status, int events){
+    IpcServer* s = static_cast<IpcServer*>(handle->data);
+    if(status < 0) return;
+    ShmChannel::drain(s->get_channel()->request_fd);
+    s->serve_ring();
+  }
+
   static void on_new_client(uv_stream_t* server, int status){
     IpcServer* s = (IpcServer*)server->data;
     ipc_call* ipc = new ipc_call();
     uv_pipe_init(s->get_loop(), &ipc->handle, 0);
     ipc->handle.data = ipc;
+    ipc->server = s;
     ipc->callback = s->get_callback();
     if (uv_accept(server, (uv_stream_t*)&ipc->handle) == 0) {
       uv_read_start((uv_stream_t*)&ipc->handle, alloc_buffer, on_read);
+      s->set_client(ipc);
+      s->serve_ring();
     } else {
       uv_close((uv_handle_t*)&ipc->handle, free_ipc_handle);
     }
   }
 
+  // every complete request frame is handed to the callback, which answers with send
   static void on_read(uv_stream_t* client, ssize_t nread,const uv_buf_t* buf){
+    ipc_call* ipc = static_cast<ipc_call*>(client->data);
     if (nread > 0) {
-      ipc_call* ipc = static_cast<ipc_call*>(client->data);
-      IpcServer* server = static_cast<IpcServer*>(ipc->callback);
-      ipc->req.base = CharCopy(buf->base, nread);
-      ipc->req.len = nread;
-      uv_async_init(server->get_loop(), &ipc->async_write, async_write); // create async handler
-      ipc_callback* _callback = static_cast<ipc_callback*>(ipc->callback);
-      (*_callback)(ipc);
-    } else {
+      bool valid = ipc->reader.feed(buf->base, nread, [ipc](uint32_t id, const char* payload, size_t length){
+        ipc->free_req();
+        ipc->req.base = CharCopy(payload, length);
+        ipc->req.len = length;
+        ipc->req_id = id;
+        ipc_callback* _callback = static_cast<ipc_callback*>(ipc->callback);
+        (*_callback)(ipc);
+      });
+      if (!valid && !uv_is_closing((uv_handle_t*)client)) {
+        fprintf(stderr, "IPC Server invalid frame\n");
+        uv_close((uv_handle_t*)client, free_ipc_handle);
+      }
+    } else if (nread < 0 && !uv_is_closing((uv_handle_t*)client)) {
       if (nread != UV_EOF)
         fprintf(stderr, "IPC Server Read error %s\n", uv_err_name(nread));
       uv_close((uv_handle_t*)client, free_ipc_handle);
@@ -504,4 +1878,4 @@ namespace ipc {
     free(buf->base);
   }
 
-}
\ No newline at end of file
+}
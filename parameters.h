@@ -1,7 +1,57 @@
 // Engine Parameters
-static const long timeout = 2000;
+static const long timeout = 2000; // ms a request may wait for its render before the fallback page is sent
 static const long cache_timeout = 400*1000;
+static const long cache_stale_while_revalidate = 60*1000; // ms an expired page is served while it is rendered again
+static const long cache_stale_if_error = 300*1000; // ms an expired page is served when its render fails
+static const size_t cache_budget_bytes = 256*1024*1024; // memory used by cached pages, least recently used pages are evicted
+static const int cache_shards = 16; // independently locked parts of the page cache
+static const long cache_tick = 1000; // ms between two runs of the cache expiry timer
 static const int num_process = 4;
 static const int num_v8_internal_threads = 1;
 static const bool enable_cache = false;
+static const long keep_alive_timeout = 5000; // idle time before a persistent connection is closed
+static const int max_keep_alive_requests = 100; // requests served before a persistent connection is closed
+static const int num_http_loops = 0; // http event loops accepting connections, 0 uses the number of cores
+static const int connection_pool_size = 1024; // pooled connection wrappers per http event loop
+static const int write_pool_size = 1024; // pooled write requests per http event loop
+static const int read_buffer_pool_size = 64; // pooled read buffers per http event loop
+static const int read_buffer_size = 65536;
+static const long pool_stats_interval = 0; // print pool counters every n ms, 0 disables
+static const int max_request_header_size = 8192; // bytes of request headers kept per request
+static const char* forward_headers[] = {"Cookie", "Accept-Language", "User-Agent", "Host"}; // request headers sent to the renderer
+static const char* shared_forward_headers[] = {"Host"}; // sent instead for cacheable routes, whose page is served to every client
+static const bool enable_compression = true; // gzip or deflate rendered pages when the client accepts it
+static const int compression_level = 6;
+static const int compression_min_size = 1024; // smaller bodies are sent uncompressed
+static const int static_fd_cache_size = 256; // open files kept per http event loop for static routes
+static const long static_stat_ttl = 2000; // ms before a cached static file is stat again
+static const long file_send_max_backoff = 64; // ms between sendfile attempts on a socket that stays full
+static const int max_connections = 10000; // open connections over every http event loop, more are answered with 503
+static const int max_in_flight_renders = 512; // requests waiting for a renderer, more are answered with 503
+static const int retry_after = 1; // seconds sent in Retry-After of 503 responses
+static const long deadline_check_interval = 100; // ms between checks of render deadlines in the balancer
+static const char* fallback_page = "<html><head></head><body></body></html>"; // sent when a render fails, the client renders the page itself
+static const char* render_fallback_marker = "<!--render-fallback-->"; // prefix of the fallback page sent by a renderer
+static const bool coalesce_cacheable = true; // identical in-flight renders of cacheable urls share one render
+static const bool enable_disk_cache = false; // keep rendered pages on disk across restarts, needs enable_cache
+static const char* disk_cache_path = "/tmp/v8_render_cache"; // directory of the disk cache index and data files
+static const size_t disk_cache_max_bytes = 1024L*1024*1024; // data file size after which no more pages are written
+static const char* cache_rules_path = "cache.rules"; // cache rules loaded at startup, the built-in routes are used when missing
+static const char* warm_up_path = "warmup.urls"; // urls or sitemap rendered into the cache at startup
+static const int warm_up_concurrency = 8; // warm-up renders in flight
+static const double warm_up_fraction = 0.9; // part of the warm-up renders cached before the server is ready
+static const int warm_up_attempts = 3; // renders of a warm-up url before it is given up
+static const char* readiness_path = "/ready"; // answers 503 until the server is ready, then 200
+static const bool enable_etag = true; // tag rendered pages and answer 304 to If-None-Match
+static const int renderer_pipeline_depth = 4; // requests outstanding on one renderer pipe
+static const uint32_t max_frame_size = 64*1024*1024; // larger renderer frames close the pipe
+static const size_t frame_buffer_size = 512*1024; // pooled buffer a rendered page is read into, larger pages are malloc'd
+static const int frame_pool_size = 64; // pooled page buffers kept by the balancer
+static const bool enable_shm_transport = false; // exchange frames with the renderers through shared memory rings
+static const size_t shm_ring_size = 8*1024*1024; // answer ring of one renderer, a multiple of 16, larger pages go over the pipe
+static const char* worker_policy = "p2c_latency"; // renderer chosen for a job : round_robin, least_outstanding or p2c_latency
+static const double latency_ewma_weight = 0.2; // weight of the last render in the render latency average of a renderer
+static const long renderer_restart_delay = 1000; // ms before a renderer that exited is forked again, and between reconnects
+static const long renderer_max_restart_delay = 60000; // restart delay doubles for every quick exit in a row up to this
+static const long renderer_stable_after = 10000; // ms a renderer runs before its exit no longer counts as a quick exit
 // End Engine Parameters
\ No newline at end of file
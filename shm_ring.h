@@ -0,0 +1,181 @@
+// pragma once is a non-standard but widely supported preprocessor directive,
+// designed to cause the current source file to be included only once in a single compilation
+#pragma once
+#include "components.h"
+
+#include <new>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#define SHM_RECORD_ALIGN 16
+#define SHM_WRAP UINT32_MAX
+
+// Record in a ring, followed by length bytes of payload and padded to SHM_RECORD_ALIGN.
+// A record of length SHM_WRAP fills the end of the ring, the next record starts at offset 0
+typedef struct shm_record {
+  uint32_t id;
+  uint32_t length;
+  atomic<uint32_t> released;
+  uint32_t reserved;
+} shm_record;
+
+// Single producer single consumer ring of records in shared memory. Positions only grow,
+// the offset in data is position % capacity. The consumer reads up to tail and may release
+// records out of order, head only moves over released records so a payload stays in place
+// until whoever borrowed it is done
+typedef struct shm_ring {
+  atomic<uint64_t> head; // bytes before head are free
+  atomic<uint64_t> tail; // bytes before tail are written
+  uint64_t capacity;
+  atomic<uint64_t> read; // consumer cursor, between head and tail
+
+  char* data(){
+    return (char*) this + sizeof(shm_ring);
+  }
+
+  shm_record* at(uint64_t position){
+    return (shm_record*)(data() + position % capacity);
+  }
+
+  static size_t record_size(size_t length){
+    return (sizeof(shm_record) + length + SHM_RECORD_ALIGN - 1) & ~((size_t) SHM_RECORD_ALIGN - 1);
+  }
+
+  // producer side, false when the record does not fit in the free space
+  bool write(uint32_t id, const char* payload, size_t length){
+    size_t need = record_size(length);
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    size_t contiguous = capacity - t % capacity;
+    size_t skip = need > contiguous ? contiguous : 0;
+    if(need > capacity || t + skip + need - h > capacity) return false;
+
+    if(skip > 0){
+      shm_record* wrap = at(t);
+      wrap->length = SHM_WRAP;
+      wrap->released.store(0, std::memory_order_relaxed);
+      t += skip;
+    }
+    shm_record* record = at(t);
+    record->id = id;
+    record->length = length;
+    record->released.store(0, std::memory_order_relaxed);
+    memcpy((char*) record + sizeof(shm_record), payload, length);
+    tail.store(t + need, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side, next record written by the producer or NULL
+  shm_record* next(){
+    uint64_t r = read.load(std::memory_order_relaxed);
+    while(r < tail.load(std::memory_order_acquire)){
+      shm_record* record = at(r);
+      if(record->length == SHM_WRAP){
+        record->released.store(1, std::memory_order_relaxed);
+        r += capacity - r % capacity;
+        read.store(r, std::memory_order_release);
+        continue;
+      }
+      read.store(r + record_size(record->length), std::memory_order_release);
+      return record;
+    }
+    return NULL;
+  }
+
+  // consumer side, callers on several threads must hold a common lock
+  void release(shm_record* record){
+    record->released.store(1, std::memory_order_release);
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t r = read.load(std::memory_order_acquire);
+    while(h < r){
+      shm_record* done = at(h);
+      if(!done->released.load(std::memory_order_acquire)) break;
+      h += done->length == SHM_WRAP ? capacity - h % capacity : record_size(done->length);
+    }
+    head.store(h, std::memory_order_release);
+  }
+} shm_ring;
+
+// Shared memory transport between the balancer and one renderer : a request ring and an
+// answer ring in one memfd mapping, created before fork. Each side is woken through an eventfd
+// polled by its event loop. A frame that does not fit in its ring goes over the pipe instead
+class ShmChannel {
+  private:
+    std::mutex release_guard; // answers are released from the http loops
+
+  public:
+    int memory_fd;
+    int request_fd; // eventfd the renderer polls
+    int answer_fd; // eventfd the balancer polls
+    size_t size;
+    shm_ring* requests;
+    shm_ring* answers;
+
+    // requests are small, the answer ring gets most of the memory
+    ShmChannel(size_t ring_size){
+      memory_fd = -1;
+      request_fd = -1;
+      answer_fd = -1;
+      requests = NULL;
+      answers = NULL;
+      size_t request_capacity = 64 * 1024;
+      size = 2 * sizeof(shm_ring) + request_capacity + ring_size;
+
+      memory_fd = memfd_create("v8-renderer-ring", 0);
+      if(memory_fd < 0 || ftruncate(memory_fd, size) != 0) return;
+      void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+      if(m == MAP_FAILED) return;
+
+      requests = new (m) shm_ring();
+      requests->capacity = request_capacity;
+      answers = new ((char*) m + sizeof(shm_ring) + request_capacity) shm_ring();
+      answers->capacity = ring_size;
+      reset();
+
+      request_fd = eventfd(0, EFD_NONBLOCK);
+      answer_fd = eventfd(0, EFD_NONBLOCK);
+    };
+
+    ~ShmChannel(){};
+
+    bool isOpen(){
+      return requests != NULL && request_fd >= 0 && answer_fd >= 0;
+    }
+
+    // empty both rings, only while no renderer is attached
+    void reset(){
+      for(shm_ring* ring : {requests, answers}) clear(ring);
+    }
+
+    // empty the request ring while the renderer is not connected, it does not read it then.
+    // The answer ring is kept : a renderer forked again writes after the answers still borrowed
+    void resetRequests(){
+      clear(requests);
+    }
+
+    static void clear(shm_ring* ring){
+      ring->head.store(0);
+      ring->tail.store(0);
+      ring->read.store(0);
+    }
+
+    static void notify(int fd){
+      eventfd_write(fd, 1);
+    }
+
+    // clear the wakeup before the ring is drained
+    static void drain(int fd){
+      eventfd_t value;
+      eventfd_read(fd, &value);
+    }
+
+    void releaseAnswer(shm_record* record){
+      std::lock_guard<std::mutex> lock(release_guard);
+      answers->release(record);
+    }
+};
+
+// give a borrowed answer payload back to its ring, hint is the channel
+static void release_shm_answer(char* payload, void* channel){
+  static_cast<ShmChannel*>(channel)->releaseAnswer((shm_record*)(payload - sizeof(shm_record)));
+}
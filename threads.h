@@ -11,9 +11,14 @@
 #include <algorithm>
 #include <cstring>
 #include <regex>
+#include <fstream>
+#include <fnmatch.h>
 #include <curl/curl.h>
 
 #include <queue>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>